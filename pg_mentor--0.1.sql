@@ -30,6 +30,9 @@ LANGUAGE C;
 -- operation and returns false. So, check the return value and re-call it again
 -- if necessary.
 --
+-- fixed - pin the mode: store it in the pinned_modes table and don't allow
+-- strategies to change it. Call without fixed to remove the pin.
+--
 CREATE FUNCTION pg_mentor_set_plan_mode(queryId bigint,
 										status integer,
 										ref_total_time float8 DEFAULT NULL,
@@ -39,13 +42,105 @@ RETURNS bool
 AS 'MODULE_PATHNAME', 'pg_mentor_set_plan_mode'
 LANGUAGE C;
 
+--
+-- Fixed plan cache modes (see pg_mentor_set_plan_mode). The table is the
+-- source of truth: the shared state is loaded from it on creation and follows
+-- its committed changes only, so a pin made by pg_mentor_set_plan_mode takes
+-- effect at commit. NULL reference values are taken from the statistics.
+--
+CREATE TABLE pinned_modes (
+  queryid bigint PRIMARY KEY,
+  plan_cache_mode integer NOT NULL CHECK (plan_cache_mode BETWEEN 0 AND 2),
+  ref_exec_time float8,
+  ref_nblocks float8,
+  pinned_at timestamptz NOT NULL DEFAULT now()
+);
+SELECT pg_catalog.pg_extension_config_dump('pinned_modes', '');
+
+CREATE FUNCTION pg_mentor_pins_changed()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'pg_mentor_pins_changed'
+LANGUAGE C;
+
+CREATE TRIGGER pinned_modes_changed
+AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON pinned_modes
+FOR EACH STATEMENT EXECUTE FUNCTION pg_mentor_pins_changed();
+
+--
+-- Set latency target (planning plus execution, ms) of the statement. NULL
+-- removes the target. Statements with a target are managed by the SLO rule
+-- of the strategy, which minimises p99 latency instead of the average.
+--
+CREATE FUNCTION pg_mentor_set_slo(queryId bigint, target_ms float8)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'pg_mentor_set_slo'
+LANGUAGE C;
+
+--
+-- SLO compliance of statements with a latency target: p99 latency estimates
+-- of generic and custom plans and the share of executions meeting the target
+-- before and after the last plan mode switch.
+--
+CREATE FUNCTION pg_mentor_slo_report(
+  OUT queryid bigint,
+  OUT target_ms float8,
+  OUT plan_cache_mode integer,
+  OUT p99_custom float8,
+  OUT p99_generic float8,
+  OUT switched_at timestamptz,
+  OUT calls_before bigint,
+  OUT violations_before bigint,
+  OUT compliance_before float8,
+  OUT calls_after bigint,
+  OUT violations_after bigint,
+  OUT compliance_after float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_slo_report'
+LANGUAGE C;
+
+--
+-- Override a planner setting (enable_nestloop, random_page_cost, etc.) for
+-- the statement. The value is applied on each planning of the queryId only;
+-- NULL removes the override. At most 8 settings per statement.
+--
+CREATE FUNCTION pg_mentor_set_planner_setting(queryId bigint, name text,
+											  value text)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'pg_mentor_set_planner_setting'
+LANGUAGE C;
+
+CREATE FUNCTION pg_mentor_show_planner_settings(
+  OUT queryid bigint,
+  OUT name text,
+  OUT value text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_show_planner_settings'
+LANGUAGE C;
+
 --
 -- Returns description of queries that are under control at the moment
 -- status: -1 = return all the statements; 0 - in the "AUTO" mode;
 -- 1 - forced to build generic plan; 2 - forced to build custom plan.
 --
+-- Optional filters are applied during the scan of the shared table:
+-- queryids - show only these statements (looked up directly, without a scan);
+-- min_samples - minimal number of collected execution samples;
+-- min_exec_time - minimal average execution time, ms;
+-- top_n - if positive, show only N statements with the largest total
+--   execution time, ordered by it;
+-- with_samples - if false, don't form the nblocks and exec_times arrays.
+--
+-- last_executed and last_planned are start times of the statements that
+-- executed and planned it last; call_rate is the number of executions per
+-- second, exponentially decayed over about a minute.
+--
 CREATE FUNCTION pg_mentor_show_prepared_statements(
   IN status integer,
+  IN queryids bigint[] DEFAULT NULL,
+  IN min_samples integer DEFAULT 0,
+  IN min_exec_time float8 DEFAULT 0,
+  IN top_n integer DEFAULT 0,
+  IN with_samples boolean DEFAULT true,
   OUT queryid bigint,
   OUT refcounter integer,
   OUT plan_cache_mode int,
@@ -58,12 +153,185 @@ CREATE FUNCTION pg_mentor_show_prepared_statements(
   OUT avg_exec_time float8,
   OUT ref_nblocks float8,
   OUT ref_exec_time float8,
-  OUT plan_time float8)
+  OUT plan_time float8,
+  OUT calls bigint,
+  OUT total_time float8,
+  OUT last_executed timestamptz,
+  OUT last_planned timestamptz,
+  OUT call_rate float8)
 RETURNS SETOF record
 AS 'MODULE_PATHNAME', 'pg_mentor_show_prepared_statements'
 LANGUAGE C;
 
-CREATE FUNCTION pg_mentor_reset()
+--
+-- Export state of the extension as a single text blob in the OpenMetrics
+-- format: aggregated counters and per-statement gauges for top_k statements
+-- with the largest total execution time.
+--
+CREATE FUNCTION pg_mentor_metrics(top_k integer DEFAULT 10)
+RETURNS text
+AS 'MODULE_PATHNAME', 'pg_mentor_metrics'
+LANGUAGE C STRICT;
+
+--
+-- Average time (ms) spent in each executor phase by tracked statements,
+-- separately for generic and custom plans. Execution time (run and finish)
+-- and blocks per processed row allow to compare plan kinds of a statement
+-- whose result size depends on parameters.
+--
+CREATE FUNCTION pg_mentor_show_exec_phases(
+  OUT queryid bigint,
+  OUT plan_kind text,
+  OUT calls bigint,
+  OUT start_time float8,
+  OUT run_time float8,
+  OUT finish_time float8,
+  OUT end_time float8,
+  OUT rows bigint,
+  OUT time_per_row float8,
+  OUT blocks_per_row float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_show_exec_phases'
+LANGUAGE C;
+
+--
+-- Statements prepared at least min_prepares times since the last reset of
+-- statistics. Each PREPARE repeated after a DEALLOCATE pays parse analysis
+-- again: wasted_time estimates this overhead, ms. High prepares_per_call
+-- means the client side uses each preparation just a few times.
+--
+CREATE FUNCTION pg_mentor_prepare_churn(
+  IN min_prepares bigint DEFAULT 2,
+  OUT queryid bigint,
+  OUT prepares bigint,
+  OUT deallocates bigint,
+  OUT calls bigint,
+  OUT prepares_per_sec float8,
+  OUT prepares_per_call float8,
+  OUT avg_prepare_time float8,
+  OUT wasted_time float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_prepare_churn'
+LANGUAGE C STRICT;
+
+--
+-- Shapes of tracked statements (see pg_mentor.shape_pooling): queryIds of
+-- the members, the plan cache mode learned on the shape (NULL if not decided
+-- yet) and pooled number of executions and average latency (planning plus
+-- execution, ms) per plan kind.
+--
+CREATE FUNCTION pg_mentor_show_shapes(
+  OUT shape bigint,
+  OUT members bigint[],
+  OUT plan_cache_mode integer,
+  OUT custom_calls bigint,
+  OUT custom_latency float8,
+  OUT generic_calls bigint,
+  OUT generic_latency float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_show_shapes'
+LANGUAGE C;
+
+--
+-- Executions captured as outliers (see pg_mentor.outlier_percentile), the
+-- oldest first: execution time and the threshold it exceeded, ms, number of
+-- blocks and bound parameter values. Values not fitted into the record are
+-- replaced by '...'. Parameter values may be sensitive, so only members of
+-- pg_read_all_stats may call it by default.
+--
+CREATE FUNCTION pg_mentor_show_outliers(
+  OUT queryid bigint,
+  OUT plan_kind text,
+  OUT captured_at timestamptz,
+  OUT exec_time float8,
+  OUT threshold float8,
+  OUT nblocks bigint,
+  OUT params text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_show_outliers'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pg_mentor_show_outliers() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_mentor_show_outliers() TO pg_read_all_stats;
+
+--
+-- Launch the shadow planner (see pg_mentor.shadow_planning) for the current
+-- database: each statement not planned yet is planned generically and with
+-- parameter values sampled from one of its executions, never executing.
+-- With wait => true returns when the planner finishes. Only superusers may
+-- call it by default.
+--
+CREATE FUNCTION pg_mentor_shadow_plan(wait bool DEFAULT true)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'pg_mentor_shadow_plan'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_mentor_shadow_plan(bool) FROM PUBLIC;
+
+--
+-- Results of the shadow planning: planning time, ms, and estimated cost of
+-- custom and generic plans. NULL if the statement couldn't be planned.
+--
+CREATE FUNCTION pg_mentor_show_shadow_plans(
+  OUT queryid bigint,
+  OUT planned_at timestamptz,
+  OUT custom_plan_time float8,
+  OUT custom_cost float8,
+  OUT generic_plan_time float8,
+  OUT generic_cost float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_show_shadow_plans'
+LANGUAGE C;
+
+--
+-- Cost-to-time calibration of the database: linear regression of measured
+-- execution time (ms) of tracked statements on the estimated cost of the
+-- executed plan, per plan kind. Old samples are forgotten exponentially.
+-- NULL if there are not enough samples yet.
+--
+CREATE FUNCTION pg_mentor_calibration(
+  OUT plan_kind text,
+  OUT samples bigint,
+  OUT ms_per_cost float8,
+  OUT intercept_ms float8,
+  OUT r2 float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_calibration'
+LANGUAGE C;
+
+--
+-- Databases served by the cluster-wide scheduler (pg_mentor.scheduler) with
+-- executions and regressions reported since their last run. Empty if the
+-- scheduler is off.
+--
+CREATE FUNCTION pg_mentor_show_scheduler(
+  OUT dbid oid,
+  OUT new_samples bigint,
+  OUT new_regressions bigint,
+  OUT runs bigint,
+  OUT last_run timestamptz,
+  OUT last_duration float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_show_scheduler'
+LANGUAGE C;
+
+--
+-- Clean decisions and statistics. Returns number of affected entries.
+--
+-- Without arguments resets the whole table. Filters (NULL means 'any'):
+-- queryids - only these statements;
+-- status - only statements in this plan cache mode;
+-- older_than - only statements added to the table earlier than this;
+-- relid - only statements depending on this relation or its partitioned
+--   ancestors. Statements depending on more than 8 relations are not matched.
+-- Set stats or decisions to false to keep the corresponding part of entries.
+--
+CREATE FUNCTION pg_mentor_reset(queryids bigint[] DEFAULT NULL,
+								status integer DEFAULT NULL,
+								older_than interval DEFAULT NULL,
+								relid regclass DEFAULT NULL,
+								stats boolean DEFAULT true,
+								decisions boolean DEFAULT true)
 RETURNS integer
 AS 'MODULE_PATHNAME', 'pg_mentor_reset'
 LANGUAGE C;
@@ -93,3 +361,94 @@ CREATE FUNCTION reconsider_ps_modes(OUT to_generic bigint,
 RETURNS record
 AS 'MODULE_PATHNAME', 'reconsider_ps_modes'
 LANGUAGE C;
+
+--
+-- Run the same strategy as reconsider_ps_modes and return each switch made
+-- with the test it is based on: the metric, its mean (or difference of means
+-- between plan kinds), the rule threshold, confidence interval and one-sided
+-- p-value.
+--
+CREATE FUNCTION pg_mentor_reconsider(
+  OUT queryid bigint,
+  OUT rule text,
+  OUT old_mode integer,
+  OUT new_mode integer,
+  OUT metric text,
+  OUT mean float8,
+  OUT reference float8,
+  OUT ci_low float8,
+  OUT ci_high float8,
+  OUT p_value float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_reconsider'
+LANGUAGE C;
+
+--
+-- Planning CPU budget strategy. Forces generic plans on statements with the
+-- largest planning time per second (since the last statistics reset) until
+-- the projected planning time fits into the target: ms per second or, with
+-- share => true, a share of the time tracked statements spend in planning and
+-- execution. Statements whose generic plan executes slower than the custom
+-- one by more than tolerance (relative) are skipped.
+-- Each row describes a considered statement; measured and projected show
+-- planning ms per second over all the tracked statements.
+--
+CREATE FUNCTION pg_mentor_planning_budget(target float8,
+  tolerance float8 DEFAULT 0.1,
+  share bool DEFAULT false,
+  dry_run bool DEFAULT false,
+  OUT queryid bigint,
+  OUT plan_ms_per_sec float8,
+  OUT generic_penalty float8,
+  OUT switched bool,
+  OUT measured float8,
+  OUT projected float8,
+  OUT target_ms_per_sec float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_planning_budget'
+LANGUAGE C STRICT;
+
+--
+-- Hourly statistics history (see pg_mentor.history_buckets): number of
+-- executions and average latency (ms, including planning for custom plans)
+-- per hour and plan kind.
+--
+CREATE FUNCTION pg_mentor_show_history(
+  OUT queryid bigint,
+  OUT hour timestamptz,
+  OUT plan_kind text,
+  OUT calls bigint,
+  OUT avg_latency float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_show_history'
+LANGUAGE C;
+
+--
+-- Learn plan mode schedule by hour of the day (UTC) from the history. For
+-- each hour the plan kind faster by more than margin is scheduled if both
+-- kinds have at least min_calls executions. Scheduled modes are applied at
+-- the beginning of each hour. Returns the schedule learned.
+--
+CREATE FUNCTION pg_mentor_learn_schedule(min_calls integer DEFAULT 10,
+  margin float8 DEFAULT 0.1,
+  OUT queryid bigint,
+  OUT hour integer,
+  OUT plan_cache_mode integer,
+  OUT custom_latency float8,
+  OUT generic_latency float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_learn_schedule'
+LANGUAGE C STRICT;
+
+--
+-- Micro-benchmark: per-call overhead of the timing sources, available on this
+-- machine. The 'active' column shows the one chosen by pg_mentor.timing_source.
+--
+CREATE FUNCTION pg_mentor_timing_overhead(loops integer DEFAULT 1000000,
+										  OUT source text,
+										  OUT active boolean,
+										  OUT calls integer,
+										  OUT ns_per_call float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_mentor_timing_overhead'
+LANGUAGE C STRICT;
@@ -13,23 +13,60 @@
 
 #include "postgres.h"
 
+#include <math.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#include <x86intrin.h>
+#define PGM_HAVE_TSC
+#endif
+
+#include "access/heapam.h"
 #include "access/parallel.h"
+#include "access/table.h"
+#include "access/tableam.h"
 #include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/namespace.h"
+#include "catalog/partition.h"
+#include "catalog/pg_database.h"
+#include "catalog/pg_extension.h"
 #include "commands/extension.h"
 #include "commands/prepare.h"
+#include "commands/trigger.h"
+#include "common/hashfn.h"
+#include "common/int.h"
 #include "executor/executor.h"
+#include "executor/spi.h"
 #include "funcapi.h"
+#include "lib/binaryheap.h"
 #include "lib/dshash.h"
+#include "lib/qunique.h"
 #include "nodes/execnodes.h"
+#include "nodes/nodeFuncs.h"
 #include "miscadmin.h"
 #include "optimizer/planner.h"
 #include "parser/analyze.h"
+#include "pgstat.h"
+#include "port/pg_bitutils.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
 #include "storage/dsm_registry.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lwlock.h"
+#include "storage/sinval.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
 #include "tcop/utility.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/guc.h"
+#include "utils/guc_tables.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/snapmgr.h"
 #include "utils/timestamp.h"
 
 #define MODULENAME	"pg_mentor"
@@ -41,9 +78,32 @@ PG_MODULE_MAGIC_EXT(
 
 PG_FUNCTION_INFO_V1(pg_mentor_reload_conf);
 PG_FUNCTION_INFO_V1(pg_mentor_set_plan_mode);
+PG_FUNCTION_INFO_V1(pg_mentor_pins_changed);
 PG_FUNCTION_INFO_V1(pg_mentor_show_prepared_statements);
 PG_FUNCTION_INFO_V1(pg_mentor_reset);
 PG_FUNCTION_INFO_V1(reconsider_ps_modes);
+PG_FUNCTION_INFO_V1(pg_mentor_reconsider);
+PG_FUNCTION_INFO_V1(pg_mentor_set_slo);
+PG_FUNCTION_INFO_V1(pg_mentor_slo_report);
+PG_FUNCTION_INFO_V1(pg_mentor_planning_budget);
+PG_FUNCTION_INFO_V1(pg_mentor_set_planner_setting);
+PG_FUNCTION_INFO_V1(pg_mentor_show_planner_settings);
+PG_FUNCTION_INFO_V1(pg_mentor_show_history);
+PG_FUNCTION_INFO_V1(pg_mentor_learn_schedule);
+PG_FUNCTION_INFO_V1(pg_mentor_timing_overhead);
+PG_FUNCTION_INFO_V1(pg_mentor_metrics);
+PG_FUNCTION_INFO_V1(pg_mentor_show_exec_phases);
+PG_FUNCTION_INFO_V1(pg_mentor_prepare_churn);
+PG_FUNCTION_INFO_V1(pg_mentor_show_shapes);
+PG_FUNCTION_INFO_V1(pg_mentor_show_outliers);
+PG_FUNCTION_INFO_V1(pg_mentor_shadow_plan);
+PG_FUNCTION_INFO_V1(pg_mentor_show_shadow_plans);
+PG_FUNCTION_INFO_V1(pg_mentor_calibration);
+PG_FUNCTION_INFO_V1(pg_mentor_show_scheduler);
+
+PGDLLEXPORT void pgm_shadow_main(Datum main_arg);
+PGDLLEXPORT void pgm_scheduler_main(Datum main_arg);
+PGDLLEXPORT void pgm_scheduler_worker_main(Datum main_arg);
 
 static const char  *psfuncname = "pg_prepared_statement";
 static Oid			psfuncoid = 0;
@@ -66,6 +126,91 @@ static ExecutorRun_hook_type prev_ExecutorRun = NULL;
 static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
 
+/*
+ * Event counters, exported by pg_mentor_metrics().
+ *
+ * Decisions go first: they are indexed by the switching rule.
+ */
+typedef enum PGMCounter
+{
+	PGM_DECISION_AUTO_TO_GENERIC = 0,
+	PGM_DECISION_GENERIC_TO_CUSTOM,
+	PGM_DECISION_AUTO_TO_CUSTOM,
+	PGM_DECISION_CUSTOM_TO_GENERIC,
+	PGM_DECISION_STARTUP_TO_CUSTOM,
+	PGM_DECISION_SLO,
+	PGM_DECISION_PLANNING_BUDGET,
+	PGM_DECISION_SCHEDULE,
+	PGM_DECISION_SHAPE,
+	PGM_DECISION_SHADOW,
+	PGM_DECISION_MANUAL,
+
+	PGM_COUNTER_RECONSIDER, /* strategy runs */
+	PGM_COUNTER_CHECK_STATE, /* plan modes refreshed by a backend */
+	PGM_COUNTER_RESET, /* pg_mentor_reset calls */
+	PGM_COUNTER_FLUSH, /* batches of registrations flushed by backends */
+
+	PGM_COUNTERS_NUM
+} PGMCounter;
+
+#define PGM_DECISIONS_NUM	(PGM_DECISION_MANUAL + 1)
+
+static const char *const decision_names[PGM_DECISIONS_NUM] = {
+	"auto_to_generic",
+	"generic_to_custom",
+	"auto_to_custom",
+	"custom_to_generic",
+	"generic_startup_to_custom",
+	"slo",
+	"planning_budget",
+	"schedule",
+	"shape",
+	"shadow",
+	"manual"
+};
+
+static const char *const plan_mode_names[] = {
+	"auto",
+	"force_generic",
+	"force_custom"
+};
+
+/*
+ * Kind of the plan, used to execute a prepared statement.
+ */
+typedef enum PGMPlanKind
+{
+	PGM_PLAN_CUSTOM = 0,
+	PGM_PLAN_GENERIC,
+
+	PGM_PLAN_KINDS
+} PGMPlanKind;
+
+static const char *const plan_kind_names[PGM_PLAN_KINDS] = {
+	"custom",
+	"generic"
+};
+
+/*
+ * Running regression of measured execution time (ms) on the estimated cost
+ * of the executed plan. Old samples are forgotten exponentially, so the
+ * model follows changes of the storage and the workload.
+ */
+typedef struct PGMCalibration
+{
+	int64		nsamples; /* total number of samples */
+	double		weight; /* decayed number of samples */
+	double		sum_x;
+	double		sum_y;
+	double		sum_xx;
+	double		sum_xy;
+	double		sum_yy;
+} PGMCalibration;
+
+#define PGM_CALIBRATION_DECAY		(1. - 1. / 10000.)
+#define PGM_CALIBRATION_MIN_WEIGHT	(10.)
+#define PGM_CALIBRATION_BATCH		(64) /* samples folded at once */
+
 /*
  * Single flag for all databases?
  *
@@ -83,39 +228,346 @@ typedef struct SharedState
 
 	dsa_handle			dsah;
 	dshash_table_handle	dshh;
+	dshash_table_handle	shapes_dshh;
+
+	pg_atomic_uint64	counters[PGM_COUNTERS_NUM];
+
+	/* Number of entries with planner settings overrides */
+	pg_atomic_uint32	noverrides;
+
+	/* The hour mode schedules have been applied for */
+	pg_atomic_uint64	schedule_hour;
+	pg_atomic_flag		schedule_busy; /* a backend is applying them */
+
+	/*
+	 * Pinned modes are re-applied from the pinned_modes table when
+	 * pins_generation runs ahead of pins_applied, by one backend at a time.
+	 */
+	pg_atomic_uint64	pins_generation;
+	pg_atomic_uint64	pins_applied;
+	pg_atomic_flag		pins_busy;
+
+	/* Buffer of captured outlier executions, allocated on the first capture */
+	LWLock				outliers_lock;
+	dsa_pointer			outliers;
+	uint64				outliers_next; /* total number of captures */
+
+	/*
+	 * Cost-to-time calibration per plan kind. Backends fold their samples
+	 * into it in batches.
+	 */
+	slock_t				calib_lock;
+	PGMCalibration		calib[PGM_PLAN_KINDS];
 
 	/* Just for DEBUG */
 	Oid					dbOid;
 } SharedState;
 
-#define MENTOR_TBL_ENTRY_FIELDS_NUM	(13)
-#define MENTOR_TBL_ENTRY_STAT_SIZE	(10)
+/*
+ * Executor phases, timed separately.
+ */
+typedef enum PGMExecPhase
+{
+	PGM_PHASE_START = 0,
+	PGM_PHASE_RUN,
+	PGM_PHASE_FINISH,
+	PGM_PHASE_END,
+
+	PGM_PHASES_NUM
+} PGMExecPhase;
+
+/*
+ * Aggregated time spent in each executor phase, ms, and the amount of work
+ * done by executions of one plan kind.
+ */
+typedef struct PGMPhaseStats
+{
+	int64		nexecs;
+	double		time[PGM_PHASES_NUM];
+	int64		rows; /* rows returned or affected */
+	int64		nblocks;
+} PGMPhaseStats;
+
+/*
+ * Aggregates of one hour of executions, per plan kind. Latency includes
+ * planning time for custom plans.
+ */
+typedef struct PGMHistoryBucket
+{
+	int64		hour; /* hours since the PostgreSQL epoch, 0 - empty */
+	int64		nexecs[PGM_PLAN_KINDS];
+	double		latency[PGM_PLAN_KINDS];
+} PGMHistoryBucket;
+
+#define HOURS_PER_DAY	(24)
+
+#define MENTOR_TBL_ENTRY_FIELDS_NUM	(18)
+#define MENTOR_TBL_ENTRY_RELIDS		(8)
 
 typedef struct MentorTblEntry
 {
 	uint64		queryid; /* the key */
-	uint32		refcounter; /* How much users use this statement? */
+	pg_atomic_uint32 refcounter; /* How much users use this statement? */
 	int			plan_cache_mode;
 	TimestampTz	since; /* The moment of addition to the table */
 
 	double		ref_exec_time; /* execution time before the switch (or -1) */
 	bool		fixed; /* May it be changed automatically? */
 
+	/*
+	 * Protects the statistics below, SLO counters, phases and history: they
+	 * are updated on each execution through a cached pointer, without the
+	 * dshash partition lock. If both are needed, the partition lock is taken
+	 * first.
+	 */
+	LWLock		lock;
+
 	/* Statistics */
-	int64		nblocks[MENTOR_TBL_ENTRY_STAT_SIZE];
-	double		times[MENTOR_TBL_ENTRY_STAT_SIZE];
 	int			next_idx;
 	double		avg_nblocks;
 	double		ref_nblocks;
 	double		avg_exec_time;
 	double		plan_time;
+	TimestampTz	stats_since; /* The moment of the last statistics reset */
+	int64		calls; /* Number of executions since the last reset */
+	double		total_time; /* Total execution time since the last reset */
+	int64		plans; /* Number of plans built since the last reset */
+	double		total_plan_time;
+
+	/*
+	 * Recency of the statement, kept over statistics resets. Statement start
+	 * time is used, so the clock isn't read once more. The call rate is
+	 * an exponentially decayed number of executions per second as of
+	 * last_executed, see entry_call_rate().
+	 */
+	TimestampTz	last_executed; /* 0 - never */
+	TimestampTz	last_planned;
+	double		call_rate;
+
+	/*
+	 * Prepare churn. As the refcounter, updated without the entry lock
+	 * through a pointer cached in the local entry.
+	 */
+	pg_atomic_uint64 prepares; /* PREPARE commands */
+	pg_atomic_uint64 deallocates; /* Dropped by DEALLOCATE [ALL] or DISCARD ALL */
+	pg_atomic_uint64 prepare_time; /* Total time of parse analysis and rewriting, ns */
+
+	/* Relations the statement depends on, -1 if unknown or too many */
+	int			nrelids;
+	Oid			relids[MENTOR_TBL_ENTRY_RELIDS];
+
+	/* Fingerprint of the statement structure, 0 - not computed */
+	uint64		shape;
+
+	/* Executor phases timing, per plan kind */
+	PGMPhaseStats	phases[PGM_PLAN_KINDS];
+
+	/*
+	 * Latency target (planning plus execution), ms, -1 if not set. Compliance
+	 * is counted separately before ([0]) and after ([1]) the last switch.
+	 */
+	double		slo;
+	TimestampTz	switched_at; /* 0 - no switches since the statistics reset */
+	int64		slo_calls[2];
+	int64		slo_violations[2];
+
+	/*
+	 * Planner settings applied on planning of the statement: a DSA chunk of
+	 * name/value pairs, each string is zero-terminated.
+	 */
+	dsa_pointer	settings;
+	Size		settings_len;
+
+	/* Plan cache mode to switch to at the beginning of each hour (UTC), or -1 */
+	int8		schedule[HOURS_PER_DAY];
+
+	/* Executions slower than this are captured as outliers, ms, -1 - unknown */
+	double		outlier_threshold;
+
+	/*
+	 * Shadow planning: source text of the statement (PGMShadowSource) and a
+	 * sample of bound parameter values captured from an execution, both in
+	 * DSA. Planning time, ms, and estimated cost of both plan kinds are
+	 * filled by the background worker, cost is -1 if planning failed.
+	 */
+	dsa_pointer	shadow_source;
+	dsa_pointer	shadow_params;
+	int			shadow_nparams; /* number of parameters of the statement */
+	Size		shadow_params_len;
+	TimestampTz	shadow_at; /* 0 - not planned yet */
+	double		shadow_plan_time[PGM_PLAN_KINDS];
+	double		shadow_cost[PGM_PLAN_KINDS];
+
+	/*
+	 * Ring buffer of the last pgm_sample_window executions, see the sample
+	 * encoding below. Codes of nblocks go first, execution times and numbers
+	 * of processed rows follow, then the bitmap of plan kinds. Use
+	 * ENTRY_NBLOCKS/ENTRY_TIMES/ENTRY_ROWS/ENTRY_KINDS to access.
+	 * Hourly history buckets (ENTRY_HISTORY) are placed after the ring.
+	 */
+	uint16		samples[FLEXIBLE_ARRAY_MEMBER];
 } MentorTblEntry;
 
+/*
+ * Size of the ring buffer, defined at server start. Entry layout depends on
+ * it, so it can't be changed without restart.
+ */
+static int	pgm_sample_window = 10;
+
+/* Judge stability of a statement by its per-row cost */
+static bool	pgm_normalize_by_rows = false;
+
+/*
+ * Confidence level required to switch plan mode, 0 - act on point estimates.
+ * Intervals reported with the disabled check are built at the 95% level.
+ */
+static double	pgm_confidence_level = 0.;
+static int		pgm_min_samples = 2;
+
+/* Statements within this fraction of their SLO aren't switched */
+static double	pgm_slo_margin = 0.1;
+
+#define pgm_ci_level() \
+	(pgm_confidence_level > 0. ? pgm_confidence_level : 0.95)
+
+/*
+ * Number of hourly buckets of statistics history, 0 - disabled. Defined at
+ * server start, as the sample window.
+ */
+static int	pgm_history_buckets = 0;
+static Size	pgm_history_offset = 0;
+
+static Size	pgm_entry_size = 0;
+
+#define ENTRY_NBLOCKS(entry)	((entry)->samples)
+#define ENTRY_TIMES(entry)		((entry)->samples + pgm_sample_window)
+#define ENTRY_ROWS(entry)		((entry)->samples + 2 * pgm_sample_window)
+#define ENTRY_KINDS(entry)		((uint8 *) (ENTRY_ROWS(entry) + pgm_sample_window))
+#define MENTOR_TBL_ENTRY_SIZE(window) \
+	(offsetof(MentorTblEntry, samples) + \
+	 (window) * 3 * sizeof(uint16) + ((window) + 7) / 8)
+#define ENTRY_HISTORY(entry) \
+	((PGMHistoryBucket *) ((char *) (entry) + pgm_history_offset))
+
+/*
+ * Statistics pooled by statements of the same shape: the same structure over
+ * different relations, as in the schema-per-tenant layout. Members without
+ * enough samples of their own inherit the plan cache mode learned on the
+ * shape.
+ */
+typedef struct PGMShapeEntry
+{
+	uint64		shape; /* the key */
+	int64		calls[PGM_PLAN_KINDS];
+	double		latency[PGM_PLAN_KINDS]; /* planning plus execution, ms */
+	double		exec_time; /* total over both plan kinds */
+	double		nblocks;
+} PGMShapeEntry;
+
+static bool	pgm_shape_pooling = false;
+
+/*
+ * Outlier executions: slower than the pgm_outlier_percentile of the ring
+ * buffer of their statement. The last PGM_OUTLIERS_NUM of them are kept with
+ * bound parameter values, serialized by datumSerialize() and prefixed by the
+ * type Oid each. Values are rendered to text only when the buffer is read.
+ */
+#define PGM_OUTLIERS_NUM			(64)
+#define PGM_OUTLIER_PARAMS_SIZE		(1024)
+
+typedef struct PGMOutlier
+{
+	uint64		queryid;
+	PGMPlanKind	plan_kind;
+	TimestampTz	captured_at;
+	double		exec_time;
+	double		threshold;
+	int64		nblocks;
+	int			nparams; /* number of parameters serialized */
+	bool		truncated; /* the rest didn't fit */
+	Size		params_len;
+	char		params[PGM_OUTLIER_PARAMS_SIZE];
+} PGMOutlier;
+
+static double	pgm_outlier_percentile = 0.;
+
+/*
+ * Shadow planning. Source text of a statement is kept with types of its
+ * parameters and the search_path it has been prepared with: PGMShadowSource
+ * header, the type Oids, then both zero-terminated strings.
+ */
+typedef struct PGMShadowSource
+{
+	int		nparams;
+	int		query_len;
+	int		search_path_len;
+	Oid		paramtypes[FLEXIBLE_ARRAY_MEMBER];
+} PGMShadowSource;
+
+#define SHADOW_SOURCE_QUERY(src) \
+	((char *) (src)->paramtypes + sizeof(Oid) * (src)->nparams)
+#define SHADOW_SOURCE_SEARCH_PATH(src) \
+	(SHADOW_SOURCE_QUERY(src) + (src)->query_len + 1)
+
+/* Longer statements aren't kept */
+#define PGM_SHADOW_MAX_QUERY_LEN	(8192)
+
+static bool		pgm_shadow_planning = false;
+
+/*
+ * Cluster-wide scheduler of the decision strategy. Each database where
+ * statements are tracked takes a slot of the registry and reports its
+ * activity there: executions (in batches) and regressions, i.e. SLO
+ * violations and outliers captured.
+ */
+#define PGM_SCHED_MAX_DATABASES		(128)
+#define PGM_SCHED_REPORT_BATCH		(64)
+#define PGM_SCHED_REGRESSION_WEIGHT	(100.)
+
+typedef struct PGMSchedSlot
+{
+	Oid					dboid; /* InvalidOid - the slot is free */
+	pg_atomic_uint64	nsamples; /* executions reported */
+	pg_atomic_uint64	nregressions;
+
+	/* The launcher's bookkeeping, protected by the registry lock */
+	uint64				seen_samples; /* as of the last run */
+	uint64				seen_regressions;
+	int64				nruns;
+	TimestampTz			last_run;
+	double				last_duration; /* ms */
+} PGMSchedSlot;
+
+typedef struct PGMSchedState
+{
+	int				tranche_id;
+	LWLock			lock;
+	PGMSchedSlot	slots[PGM_SCHED_MAX_DATABASES];
+} PGMSchedState;
+
+static bool		pgm_scheduler = false;
+static int		pgm_scheduler_naptime = 60; /* s */
+static int		pgm_scheduler_max_workers = 2;
+static int		pgm_scheduler_cycle_budget = 10000; /* ms, 0 - unlimited */
+
+static PGMSchedState   *sched = NULL;
+static PGMSchedSlot	   *sched_slot = NULL; /* of the current database */
+static uint64			sched_pending = 0; /* executions not reported yet */
+
 static dsa_area *dsa = NULL;
 
 static dshash_parameters dsh_params = {
 	sizeof(uint64),
-	sizeof(MentorTblEntry),
+	0, /* Entry size is defined on the module load */
+	dshash_memcmp,
+	dshash_memhash,
+	dshash_memcpy,
+	-1
+};
+
+static dshash_parameters shapes_dsh_params = {
+	sizeof(uint64),
+	sizeof(PGMShapeEntry),
 	dshash_memcmp,
 	dshash_memhash,
 	dshash_memcpy,
@@ -124,290 +576,4595 @@ static dshash_parameters dsh_params = {
 
 static SharedState *state = NULL;
 static dshash_table *pgm_hash = NULL;
+static dshash_table *pgm_shapes = NULL;
 static HTAB		   *pgm_local_hash = NULL; /* contains statements, prepared in this backend */
 
 static uint64 local_state_generation = 0; /* 0 - not initialised */
 
-static void on_deallocate(uint64 queryId);
-static bool pgm_init_shmem(void);
+/*
+ * Fast path for untracked queries.
+ *
+ * Most of the traffic usually isn't prepared statements, so each hook first
+ * checks two backend-local things: whether the extension exists in the
+ * database and whether any statement is prepared in this backend. The
+ * existence is looked up in the catalog once and cached. CREATE and DROP
+ * EXTENSION create and drop the pinned_modes table, so the cache is dropped
+ * on any relcache invalidation: they aren't frequent, and looking up the
+ * extension again is cheap.
+ *
+ * The planner hook also needs to know whether planner settings are
+ * overridden for any statement. The flag is read from the shared state once
+ * and kept until a change of overrides is announced by an invalidation of
+ * pg_extension, see overrides_changed().
+ */
+static Oid	pgm_extoid = InvalidOid;
+static bool	pgm_extoid_valid = false;
+static bool	pgm_overrides = false;
+static bool	pgm_overrides_valid = false;
 
-static void
-set_plan_cache_mode(PreparedStatement  *entry, int status)
+static inline Oid
+pgm_extension_oid(void)
 {
-	switch (status)
-	{
-		case 0:
-			/* PLAN_CACHE_MODE_AUTO */
-			entry->plansource->cursor_options &=
-							~(CURSOR_OPT_CUSTOM_PLAN | CURSOR_OPT_GENERIC_PLAN);
-			break;
-		case 1:
-			/* PLAN_CACHE_MODE_FORCE_GENERIC_PLAN */
-			entry->plansource->cursor_options &= ~CURSOR_OPT_CUSTOM_PLAN;
-			entry->plansource->cursor_options |= CURSOR_OPT_GENERIC_PLAN;
-			break;
-		case 2:
-			/* PLAN_CACHE_MODE_FORCE_CUSTOM_PLAN */
-			entry->plansource->cursor_options &= ~CURSOR_OPT_GENERIC_PLAN;
-			entry->plansource->cursor_options |= CURSOR_OPT_CUSTOM_PLAN;
-			break;
-		default:
-			Assert(0);
-	}
+	if (!IsTransactionState())
+		return InvalidOid;
+	if (likely(pgm_extoid_valid))
+		return pgm_extoid;
+
+	pgm_extoid = get_extension_oid(MODULENAME, true);
+	pgm_extoid_valid = true;
+	return pgm_extoid;
 }
 
-static int
-get_plan_cache_mode(PreparedStatement *ps)
+/* Are there statements prepared in this backend? */
+static inline bool
+pgm_any_tracked(void)
 {
-	if (ps->plansource->cursor_options &
-							~(CURSOR_OPT_CUSTOM_PLAN | CURSOR_OPT_GENERIC_PLAN))
-		return 0; /* PLAN_CACHE_MODE_AUTO */
-	if (ps->plansource->cursor_options & CURSOR_OPT_GENERIC_PLAN)
-		return 1; /* PLAN_CACHE_MODE_FORCE_GENERIC_PLAN */
-	if (ps->plansource->cursor_options & CURSOR_OPT_CUSTOM_PLAN)
-		return 2; /* PLAN_CACHE_MODE_FORCE_CUSTOM_PLAN */
-
-	Assert(0);
-	return -1;
+	return pgm_local_hash != NULL && hash_get_num_entries(pgm_local_hash) > 0;
 }
 
 /*
- * Call pg_prepared_statement and return list of statement names.
+ * Timing source.
  *
- * Returns list of PreparedStatement pointers
+ * Each tracked statement is timed at least four times (around planning and
+ * around each of ExecutorRun/ExecutorFinish). On some virtualised hosts
+ * clock_gettime() isn't served by vDSO and becomes noticeable for
+ * sub-millisecond statements. So, optionally read the TSC directly. It is
+ * calibrated once per server against the system clock: by the postmaster if
+ * the module is preloaded (backends inherit the result), otherwise by the
+ * first backend loading it, which leaves the result in a named DSM segment
+ * for the others. If the CPU doesn't report an invariant TSC we fall back to
+ * the clock silently (with a LOG message).
  */
-static List *
-fetch_prepared_statements(void)
+typedef enum PGMTimingSource
 {
-	FunctionCallInfo	fcinfo = palloc0(SizeForFunctionCallInfo(0));
-	ReturnSetInfo		rsinfo;
-	FmgrInfo			ps_fmgr_info;
-	List			   *pslst = NIL;
-	int64				nvalues;
+	PGM_TIMING_CLOCK,
+	PGM_TIMING_TSC
+} PGMTimingSource;
+
+static const struct config_enum_entry timing_source_options[] = {
+	{"clock", PGM_TIMING_CLOCK, false},
+	{"tsc", PGM_TIMING_TSC, false},
+	{NULL, 0, false}
+};
 
-	/*
-	 * Settings to call SRF routine. See InitMaterializedSRF.
-	 */
-	rsinfo.type = T_ReturnSetInfo;
-	rsinfo.econtext = CreateStandaloneExprContext();
-	rsinfo.expectedDesc = NULL;
-	rsinfo.allowedModes = (int) (SFRM_ValuePerCall | SFRM_Materialize);
-	rsinfo.returnMode = SFRM_Materialize;
-	rsinfo.setResult = NULL;
-	rsinfo.setDesc = NULL;
+static int		pgm_timing_source = PGM_TIMING_CLOCK; /* GUC value */
+static bool		pgm_use_tsc = false; /* Is TSC actually in use? */
+static double	pgm_ms_per_tick = 1.0 / NS_PER_MS;
 
-	fmgr_info(psfuncoid, &ps_fmgr_info);
-	InitFunctionCallInfoData(*fcinfo, &ps_fmgr_info, 0, InvalidOid, NULL, NULL);
-	fcinfo->resultinfo = (Node *) &rsinfo;
+/* Time to spend on TSC calibration, in microseconds */
+#define PGM_TSC_CALIBRATION_TIME	(20000)
 
-	(void) FunctionCallInvoke(fcinfo);
+static void on_deallocate(uint64 queryId, CachedPlanSource *plansource);
+static void flush_registrations(void);
+static void apply_schedule(void);
+static double latency_p99(MentorTblEntry *entry, int statnum, int kind);
+static bool pgm_init_shmem(void);
 
-	nvalues = tuplestore_tuple_count(rsinfo.setResult);
+/* Max number of planner settings overridden for a statement */
+#define PGM_MAX_SETTINGS	(8)
 
-	if (nvalues > 0)
-	{
-		TupleTableSlot *slot;
+#define pgm_count(counter) \
+	((void) pg_atomic_fetch_add_u64(&state->counters[(counter)], 1))
 
-		slot = MakeSingleTupleTableSlot(rsinfo.setDesc, &TTSOpsMinimalTuple);
-		while (tuplestore_gettupleslot(rsinfo.setResult, true, false, slot))
-		{
-			char			   *stmt_name;
-			bool				isnull;
-			PreparedStatement  *ps;
+/*
+ * Read current time in units of the active timing source.
+ */
+static inline uint64
+pgm_time_now(void)
+{
+	instr_time	now;
 
-			stmt_name = TextDatumGetCString(slot_getattr(slot, 1, &isnull));
-			Assert(!isnull);
+#ifdef PGM_HAVE_TSC
+	if (pgm_use_tsc)
+		return __rdtsc();
+#endif
 
-			ps = FetchPreparedStatement(stmt_name, false);
-			Assert(ps != NULL);
-			pslst = lappend(pslst, ps);
+	INSTR_TIME_SET_CURRENT(now);
+	return INSTR_TIME_GET_NANOSEC(now);
+}
 
-			ExecClearTuple(slot);
-		}
-	}
+static inline double
+pgm_ticks_to_ms(uint64 ticks)
+{
+	return (double) ticks * pgm_ms_per_tick;
+}
 
-	return pslst;
+static inline double
+pgm_time_diff_ms(uint64 start, uint64 end)
+{
+	return pgm_ticks_to_ms(end - start);
 }
 
-/*
- * The prepared_queries hash table is private core entity. So let's manage the
- * extension internal hash table. It can help us to cleanup global table on
- * backend exit.
- */
-typedef struct LocaLPSEntry
+#ifdef PGM_HAVE_TSC
+static bool
+tsc_is_invariant(void)
 {
-	uint64	queryId;
-	int32	refcounter;
-	double	plan_time;
-} LocaLPSEntry;
+	unsigned int	eax, ebx, ecx, edx;
+
+	if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 ||
+		eax < 0x80000007)
+		return false;
+
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0)
+		return false;
+
+	/* Invariant TSC bit: the counter ticks at a constant rate in all states */
+	return (edx & (1 << 8)) != 0;
+}
 
 /*
- * Does prepared statements table changed?
- *
- * Prepared statement should be revalidated before deciding on building a plan.
- * At this moment any shift in management table may be detected and new plan
- * options applied.
+ * Measure TSC frequency against the system clock.
  *
- * XXX: it seems not ideal solution due to slow down in arbitrary query
- * planning. Is this an architectural defect of Postgres or my lack of
- * understanding? Anyway, without custom invalidation messages it looks like
- * we have no alternatives.
+ * Returns milliseconds per TSC tick or a negative value if the result looks
+ * unreasonable.
  */
-static void
-check_state(void)
+static double
+tsc_calibrate(void)
 {
-	dshash_seq_status	hash_seq;
-	uint64				generation;
-	MentorTblEntry	   *entry;
-	List			   *pslst;
+	instr_time	start;
+	instr_time	end;
+	uint64		tsc_start;
+	uint64		tsc_end;
+	double		elapsed_ns;
+	double		ghz;
+
+	INSTR_TIME_SET_CURRENT(start);
+	tsc_start = __rdtsc();
+	pg_usleep(PGM_TSC_CALIBRATION_TIME);
+	tsc_end = __rdtsc();
+	INSTR_TIME_SET_CURRENT(end);
+
+	INSTR_TIME_SUBTRACT(end, start);
+	elapsed_ns = (double) INSTR_TIME_GET_NANOSEC(end);
+
+	if (tsc_end <= tsc_start || elapsed_ns <= 0.)
+		return -1.;
+
+	/* Reject anything outside of 100 MHz .. 20 GHz */
+	ghz = (double) (tsc_end - tsc_start) / elapsed_ns;
+	if (ghz < 0.1 || ghz > 20.0)
+		return -1.;
+
+	return elapsed_ns / (double) (tsc_end - tsc_start) / NS_PER_MS;
+}
 
-	generation = pg_atomic_read_u64(&state->state_decisions);
+typedef struct PGMTscState
+{
+	double	ms_per_tick; /* negative if calibration failed */
+} PGMTscState;
 
-	if (generation == local_state_generation)
-		return;
+static void
+pgm_tsc_init_state(void *ptr)
+{
+	((PGMTscState *) ptr)->ms_per_tick = tsc_calibrate();
+}
+#endif
 
-	pslst = fetch_prepared_statements();
+/*
+ * Choose the timing source according to the pg_mentor.timing_source value.
+ * Called on module load.
+ */
+static void
+pgm_timing_init(void)
+{
+	pgm_use_tsc = false;
+	pgm_ms_per_tick = 1.0 / NS_PER_MS;
 
-	if (list_length(pslst) == 0)
+	if (pgm_timing_source != PGM_TIMING_TSC)
 		return;
 
-	/*
-	 * Pass through all the table, match prepared statement with the same
-	 * queryId and set up plan type options.
-	 */
-	dshash_seq_init(&hash_seq, pgm_hash, false);
-	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+#ifdef PGM_HAVE_TSC
+	if (tsc_is_invariant())
 	{
-		ListCell *lc;
-
-		Assert(state->dbOid == MyDatabaseId);
+		double	ms_per_tick;
 
-		foreach(lc, pslst)
+		if (process_shared_preload_libraries_in_progress)
+			ms_per_tick = tsc_calibrate();
+		else
 		{
-			PreparedStatement *ps = (PreparedStatement *) lfirst(lc);
-			Query			  *query;
+			PGMTscState	   *tsc;
+			bool			found;
 
-			query = linitial_node(Query, ps->plansource->query_list);
+			tsc = GetNamedDSMSegment(MODULENAME"-tsc", sizeof(PGMTscState),
+									 pgm_tsc_init_state, &found);
+			ms_per_tick = tsc->ms_per_tick;
+		}
+
+		if (ms_per_tick > 0.)
+		{
+			pgm_ms_per_tick = ms_per_tick;
+			pgm_use_tsc = true;
+			return;
+		}
+	}
+#endif
+
+	ereport(LOG,
+			(errmsg("invariant TSC is not available, pg_mentor falls back to the system clock")));
+}
+
+/*
+ * Sample encoding.
+ *
+ * Samples are stored as 16-bit log-scaled codes: a tiny floating point
+ * number with 6-bit exponent and 10-bit mantissa. Values below 1024 are
+ * stored exactly, larger ones with relative error below 0.1%, up to 2^64.
+ * Execution time is encoded in nanoseconds. The code with all bits set is
+ * never produced and marks an empty slot.
+ *
+ * Each metric is kept in its own array (nblocks, times, rows), so statistics
+ * decode one array at a time in a branch-free loop the compiler can
+ * vectorise. Compared to plain int64/double slots, a window of the same
+ * memory holds four times more samples.
+ */
+#define PGM_SAMPLE_EMPTY		((uint16) 0xFFFF)
+#define PGM_SAMPLE_MANTISSA		(10)
+
+static inline uint16
+sample_encode(uint64 value)
+{
+	int		exponent;
+
+	if (value < (UINT64CONST(1) << PGM_SAMPLE_MANTISSA))
+		return (uint16) value;
+
+	exponent = pg_leftmost_one_pos64(value) - PGM_SAMPLE_MANTISSA + 1;
+	return (uint16) ((exponent << PGM_SAMPLE_MANTISSA) |
+					 ((value >> (exponent - 1)) &
+					  ((1 << PGM_SAMPLE_MANTISSA) - 1)));
+}
+
+static inline uint64
+sample_decode(uint16 code)
+{
+	uint64	exponent = code >> PGM_SAMPLE_MANTISSA;
+	uint64	mantissa = code & ((1 << PGM_SAMPLE_MANTISSA) - 1);
+
+	/* Implicit leading bit for normalised values, no branches */
+	mantissa |= (uint64) (exponent != 0) << PGM_SAMPLE_MANTISSA;
+	return mantissa << (exponent - (exponent != 0));
+}
+
+static inline uint16
+sample_encode_time(double ms)
+{
+	return sample_encode((uint64) (Max(ms, 0.) * NS_PER_MS));
+}
+
+static inline double
+sample_decode_time(uint16 code)
+{
+	return (double) sample_decode(code) / NS_PER_MS;
+}
+
+/*
+ * Decode n codes into an array of integer values.
+ */
+static void
+samples_decode(const uint16 *codes, int n, int64 *values)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		values[i] = (int64) sample_decode(codes[i]);
+}
+
+/*
+ * Decode n codes of execution time into an array of milliseconds.
+ */
+static void
+samples_decode_time(const uint16 *codes, int n, double *values)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		values[i] = (double) sample_decode(codes[i]) / NS_PER_MS;
+}
+
+static inline int
+sample_kind(MentorTblEntry *entry, int idx)
+{
+	return (ENTRY_KINDS(entry)[idx / 8] >> (idx % 8)) & 1;
+}
+
+static inline void
+sample_set_kind(MentorTblEntry *entry, int idx, PGMPlanKind kind)
+{
+	StaticAssertStmt(PGM_PLAN_KINDS == 2, "plan kind must fit into one bit");
+
+	if (kind == PGM_PLAN_GENERIC)
+		ENTRY_KINDS(entry)[idx / 8] |= (1 << (idx % 8));
+	else
+		ENTRY_KINDS(entry)[idx / 8] &= ~(1 << (idx % 8));
+}
+
+/* Has the statement ever been executed since the last statistics reset? */
+#define ENTRY_NEVER_EXECUTED(entry) \
+	(ENTRY_NBLOCKS(entry)[0] == PGM_SAMPLE_EMPTY)
+
+/*
+ * Clean statistics of the entry. Decisions made are kept.
+ */
+static void
+entry_reset_stats(MentorTblEntry *entry)
+{
+	int i;
+
+	entry->next_idx = 0;
+	entry->avg_nblocks = 0.;
+	entry->avg_exec_time = 0.;
+	entry->stats_since = GetCurrentTimestamp();
+	entry->calls = 0;
+	entry->total_time = 0.;
+	entry->plans = 0;
+	entry->total_plan_time = 0.;
+	pg_atomic_write_u64(&entry->prepares, 0);
+	pg_atomic_write_u64(&entry->deallocates, 0);
+	pg_atomic_write_u64(&entry->prepare_time, 0);
+	memset(entry->phases, 0, sizeof(entry->phases));
+	entry->switched_at = 0;
+	memset(entry->slo_calls, 0, sizeof(entry->slo_calls));
+	memset(entry->slo_violations, 0, sizeof(entry->slo_violations));
+	entry->outlier_threshold = -1.;
+	for (i = 0; i < 3 * pgm_sample_window; i++)
+		entry->samples[i] = PGM_SAMPLE_EMPTY;
+	memset(ENTRY_KINDS(entry), 0, (pgm_sample_window + 7) / 8);
+	if (pgm_history_buckets > 0)
+		memset(ENTRY_HISTORY(entry), 0,
+			   sizeof(PGMHistoryBucket) * pgm_history_buckets);
+}
+
+/*
+ * Call rate estimator.
+ *
+ * Each execution adds 1/tau to the rate, and the rate decays as exp(-t/tau),
+ * so it converges to the number of executions per second over the last tau
+ * seconds or so and goes down to zero for a statement nobody calls anymore.
+ */
+#define PGM_CALL_RATE_WINDOW	(60.) /* tau, seconds */
+
+/* The rate as of the given moment. Caller holds the entry lock. */
+static double
+entry_call_rate(MentorTblEntry *entry, TimestampTz now)
+{
+	double	seconds;
+
+	if (entry->last_executed == 0)
+		return 0.;
+
+	seconds = (double) Max(now - entry->last_executed, 0) / USECS_PER_SEC;
+	return entry->call_rate * exp(-seconds / PGM_CALL_RATE_WINDOW);
+}
+
+static void
+entry_count_call(MentorTblEntry *entry, TimestampTz now)
+{
+	entry->call_rate = entry_call_rate(entry, now) + 1. / PGM_CALL_RATE_WINDOW;
+	entry->last_executed = Max(entry->last_executed, now);
+}
+
+/*
+ * Initialise an entry just inserted into the table.
+ */
+static void
+entry_init(MentorTblEntry *entry, int plan_cache_mode)
+{
+	LWLockInitialize(&entry->lock, state->tranche_id);
+	pg_atomic_init_u32(&entry->refcounter, 0);
+	pg_atomic_init_u64(&entry->prepares, 0);
+	pg_atomic_init_u64(&entry->deallocates, 0);
+	pg_atomic_init_u64(&entry->prepare_time, 0);
+	entry->plan_cache_mode = plan_cache_mode;
+	entry->since = GetCurrentTimestamp();
+	entry->fixed = false;
+	entry->ref_exec_time = -1.0;
+	entry->ref_nblocks = -1.;
+	entry->plan_time = -1.;
+	entry->last_executed = 0;
+	entry->last_planned = 0;
+	entry->call_rate = 0.;
+	entry->nrelids = -1;
+	entry->shape = 0;
+	entry->slo = -1.;
+	entry->settings = InvalidDsaPointer;
+	entry->settings_len = 0;
+	memset(entry->schedule, -1, sizeof(entry->schedule));
+	entry->shadow_source = InvalidDsaPointer;
+	entry->shadow_params = InvalidDsaPointer;
+	entry->shadow_nparams = 0;
+	entry->shadow_params_len = 0;
+	entry->shadow_at = 0;
+	entry_reset_stats(entry);
+}
+
+/*
+ * Remember relations the prepared statement depends on.
+ */
+static void
+entry_set_relids(MentorTblEntry *entry, List *relationOids)
+{
+	ListCell   *lc;
+
+	if (list_length(relationOids) > MENTOR_TBL_ENTRY_RELIDS)
+	{
+		entry->nrelids = -1;
+		return;
+	}
+
+	entry->nrelids = 0;
+	foreach(lc, relationOids)
+		entry->relids[entry->nrelids++] = lfirst_oid(lc);
+}
+
+static void
+set_plan_cache_mode(CachedPlanSource *plansource, int status)
+{
+	switch (status)
+	{
+		case 0:
+			/* PLAN_CACHE_MODE_AUTO */
+			plansource->cursor_options &=
+							~(CURSOR_OPT_CUSTOM_PLAN | CURSOR_OPT_GENERIC_PLAN);
+			break;
+		case 1:
+			/* PLAN_CACHE_MODE_FORCE_GENERIC_PLAN */
+			plansource->cursor_options &= ~CURSOR_OPT_CUSTOM_PLAN;
+			plansource->cursor_options |= CURSOR_OPT_GENERIC_PLAN;
+			break;
+		case 2:
+			/* PLAN_CACHE_MODE_FORCE_CUSTOM_PLAN */
+			plansource->cursor_options &= ~CURSOR_OPT_GENERIC_PLAN;
+			plansource->cursor_options |= CURSOR_OPT_CUSTOM_PLAN;
+			break;
+		default:
+			Assert(0);
+	}
+}
+
+static int
+get_plan_cache_mode(CachedPlanSource *plansource)
+{
+	if (plansource->cursor_options &
+							~(CURSOR_OPT_CUSTOM_PLAN | CURSOR_OPT_GENERIC_PLAN))
+		return 0; /* PLAN_CACHE_MODE_AUTO */
+	if (plansource->cursor_options & CURSOR_OPT_GENERIC_PLAN)
+		return 1; /* PLAN_CACHE_MODE_FORCE_GENERIC_PLAN */
+	if (plansource->cursor_options & CURSOR_OPT_CUSTOM_PLAN)
+		return 2; /* PLAN_CACHE_MODE_FORCE_CUSTOM_PLAN */
+
+	Assert(0);
+	return -1;
+}
+
+/*
+ * Call pg_prepared_statement and return list of statement names.
+ *
+ * Returns list of PreparedStatement pointers
+ */
+static List *
+fetch_prepared_statements(void)
+{
+	FunctionCallInfo	fcinfo = palloc0(SizeForFunctionCallInfo(0));
+	ReturnSetInfo		rsinfo;
+	FmgrInfo			ps_fmgr_info;
+	List			   *pslst = NIL;
+	int64				nvalues;
+
+	/*
+	 * Settings to call SRF routine. See InitMaterializedSRF.
+	 */
+	rsinfo.type = T_ReturnSetInfo;
+	rsinfo.econtext = CreateStandaloneExprContext();
+	rsinfo.expectedDesc = NULL;
+	rsinfo.allowedModes = (int) (SFRM_ValuePerCall | SFRM_Materialize);
+	rsinfo.returnMode = SFRM_Materialize;
+	rsinfo.setResult = NULL;
+	rsinfo.setDesc = NULL;
+
+	fmgr_info(psfuncoid, &ps_fmgr_info);
+	InitFunctionCallInfoData(*fcinfo, &ps_fmgr_info, 0, InvalidOid, NULL, NULL);
+	fcinfo->resultinfo = (Node *) &rsinfo;
+
+	(void) FunctionCallInvoke(fcinfo);
+
+	nvalues = tuplestore_tuple_count(rsinfo.setResult);
+
+	if (nvalues > 0)
+	{
+		TupleTableSlot *slot;
+
+		slot = MakeSingleTupleTableSlot(rsinfo.setDesc, &TTSOpsMinimalTuple);
+		while (tuplestore_gettupleslot(rsinfo.setResult, true, false, slot))
+		{
+			char			   *stmt_name;
+			bool				isnull;
+			PreparedStatement  *ps;
+
+			stmt_name = TextDatumGetCString(slot_getattr(slot, 1, &isnull));
+			Assert(!isnull);
+
+			ps = FetchPreparedStatement(stmt_name, false);
+			Assert(ps != NULL);
+			pslst = lappend(pslst, ps);
+
+			ExecClearTuple(slot);
+		}
+	}
+
+	return pslst;
+}
+
+/*
+ * The prepared_queries hash table is private core entity. So let's manage the
+ * extension internal hash table. It can help us to cleanup global table on
+ * backend exit.
+ */
+typedef struct LocaLPSEntry
+{
+	uint64	queryId;
+	int32	refcounter;
+	double	plan_time;
+	List   *plansources; /* Plan sources of the statements with this queryId */
+
+	/*
+	 * Registrations not reported to the shared table yet. The entry is kept
+	 * with zero refcounter until the flush if all its statements have been
+	 * deallocated in the meantime.
+	 */
+	int32	pending_refs;
+	int64	pending_prepares;
+	int64	pending_deallocates;
+	double	pending_prepare_time;
+
+	/*
+	 * The shared entry, known after the first flush. dshash doesn't move
+	 * entries and they are never removed from the shared table (a reset only
+	 * clears them), so the pointer stays valid while the DSA area is mapped.
+	 * Only atomic fields and the fields protected by the entry lock are
+	 * accessed through it.
+	 */
+	MentorTblEntry *shared;
+} LocaLPSEntry;
+
+/* Number of local entries with pending registrations */
+static int	pgm_npending = 0;
+
+/* Is a PREPARE command in progress? */
+static bool	pgm_preparing = false;
+
+/*
+ * Detect which plan is going to be executed.
+ *
+ * A generic plan is kept in the plan source and its statements are passed to
+ * the executor as is. Custom plans are built for each execution and never
+ * saved there.
+ */
+static PGMPlanKind
+get_plan_kind(LocaLPSEntry *le, PlannedStmt *pstmt)
+{
+	ListCell   *lc;
+
+	foreach(lc, le->plansources)
+	{
+		CachedPlanSource *plansource = (CachedPlanSource *) lfirst(lc);
+
+		if (plansource->gplan != NULL &&
+			list_member_ptr(plansource->gplan->stmt_list, pstmt))
+			return PGM_PLAN_GENERIC;
+	}
+	return PGM_PLAN_CUSTOM;
+}
+
+/*
+ * Find the shared entry of the queryId. The partition lock is released at
+ * once: entries are never removed, so it stays in place.
+ */
+static MentorTblEntry *
+shared_entry_lookup(uint64 queryId)
+{
+	MentorTblEntry *entry;
+
+	entry = (MentorTblEntry *) dshash_find(pgm_hash, &queryId, false);
+	if (entry != NULL)
+		dshash_release_lock(pgm_hash, entry);
+	return entry;
+}
+
+/*
+ * Get the shared entry of the local one, skipping the shared table lookup
+ * if the cached pointer is still valid. NULL if the entry hasn't been
+ * reported yet.
+ */
+static MentorTblEntry *
+local_entry_shared(LocaLPSEntry *le)
+{
+	if (likely(le->shared != NULL))
+		return le->shared;
+
+	le->shared = shared_entry_lookup(le->queryId);
+	return le->shared;
+}
+
+/*
+ * Does prepared statements table changed?
+ *
+ * Prepared statement should be revalidated before deciding on building a plan.
+ * At this moment any shift in management table may be detected and new plan
+ * options applied.
+ *
+ * XXX: it seems not ideal solution due to slow down in arbitrary query
+ * planning. Is this an architectural defect of Postgres or my lack of
+ * understanding? Anyway, without custom invalidation messages it looks like
+ * we have no alternatives.
+ */
+static void
+check_state(void)
+{
+	dshash_seq_status	hash_seq;
+	uint64				generation;
+	MentorTblEntry	   *entry;
+	List			   *pslst;
+
+	generation = pg_atomic_read_u64(&state->state_decisions);
+
+	if (generation == local_state_generation)
+		return;
+
+	pgm_count(PGM_COUNTER_CHECK_STATE);
+	pslst = fetch_prepared_statements();
+
+	if (list_length(pslst) == 0)
+		return;
+
+	/*
+	 * Pass through all the table, match prepared statement with the same
+	 * queryId and set up plan type options.
+	 */
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		ListCell *lc;
+
+		Assert(state->dbOid == MyDatabaseId);
+
+		foreach(lc, pslst)
+		{
+			PreparedStatement *ps = (PreparedStatement *) lfirst(lc);
+			Query			  *query;
+
+			query = linitial_node(Query, ps->plansource->query_list);
+
+			if (query->queryId != entry->queryid)
+				continue;
+
+			set_plan_cache_mode(ps->plansource, entry->plan_cache_mode);
+		}
+	}
+	dshash_seq_term(&hash_seq);
+
+	if (local_state_generation < generation)
+		local_state_generation = generation;
+}
+
+static bool
+move_mentor_status()
+{
+	pg_atomic_fetch_add_u64(&state->state_decisions, 1);
+	return true;
+}
+
+Datum
+pg_mentor_reload_conf(PG_FUNCTION_ARGS)
+{
+	pgm_init_shmem();
+
+	move_mentor_status();
+	PG_RETURN_BOOL(true);
+}
+
+static void
+entry_switch_mode(MentorTblEntry *entry, int status)
+{
+	/* Start counting SLO compliance of the new mode */
+	if (entry->plan_cache_mode != status)
+	{
+		entry->switched_at = GetCurrentTimestamp();
+		entry->slo_calls[0] = entry->slo_calls[1];
+		entry->slo_violations[0] = entry->slo_violations[1];
+		entry->slo_calls[1] = entry->slo_violations[1] = 0;
+	}
+
+	entry->plan_cache_mode = status;
+}
+
+/*
+ * Set the mode and the reference values of the entry. Never fails: it is
+ * also used to apply pins at commit.
+ */
+static void
+entry_set_plan_mode(MentorTblEntry *entry, int status,
+					double ref_exec_time, double ref_nblocks, bool fixed)
+{
+	entry_switch_mode(entry, status);
+	entry->fixed = fixed;
+
+	entry->ref_nblocks = (ref_nblocks > 0.) ?
+											ref_nblocks : entry->avg_nblocks;
+	entry->ref_exec_time = (ref_exec_time > 0.) ?
+											ref_exec_time : entry->avg_exec_time;
+}
+
+static void
+check_reference_data(MentorTblEntry *entry, double ref_exec_time,
+					 double ref_nblocks)
+{
+	if (ENTRY_NEVER_EXECUTED(entry) && (ref_nblocks < 0. || ref_exec_time < 0.))
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("reference data cannot be null for never executed query")));
+}
+
+static bool
+pg_mentor_set_plan_mode_int(MentorTblEntry *entry, int status,
+							double ref_exec_time, double ref_nblocks, bool fixed)
+{
+	check_reference_data(entry, ref_exec_time, ref_nblocks);
+	entry_set_plan_mode(entry, status, ref_exec_time, ref_nblocks, fixed);
+
+	/* Tell other backends that they may update their statuses. */
+	move_mentor_status();
+	return true;
+}
+
+/*
+ * Pinned decisions.
+ *
+ * Fixed plan cache modes are stored in the pinned_modes table of the extension
+ * schema, so they survive restarts and get to replicas and dumps. The shared
+ * table is loaded from it in one pass when a backend first attaches to a
+ * fresh segment. A statement-level trigger on the table sends relcache
+ * invalidation at commit (also replayed on standbys). Every backend receives
+ * it, but only the first one to notice bumps the pins generation, and only
+ * one backend re-applies the pins for it. The rest just compare counters.
+ *
+ * The shared table follows the committed contents of the table only. A
+ * backend changing pins keeps its requests till the commit and doesn't
+ * re-apply pins while the transaction has written to the table: the scan
+ * would see its uncommitted rows.
+ */
+#define PGM_PINS_TABLE	"pinned_modes"
+
+typedef struct PGMPin
+{
+	uint64	queryid;
+	int		plan_cache_mode;
+	double	ref_exec_time; /* -1 if not set */
+	double	ref_nblocks;
+} PGMPin;
+
+static bool		pins_dirty = false; /* Invalidation of the table received */
+static uint64	pins_seen = 0; /* pins_generation as of the last check */
+static Oid		pins_extoid = InvalidOid; /* The extension pins_relid belongs to */
+static Oid		pins_relid = InvalidOid;
+static bool		pins_written = false; /* The transaction changed the table */
+
+/* pg_mentor_set_plan_mode call to apply at commit */
+typedef struct PGMPinRequest
+{
+	MentorTblEntry	   *entry;
+	int					status;
+	double				ref_exec_time;
+	double				ref_nblocks;
+	bool				fixed;
+	SubTransactionId	subid;
+} PGMPinRequest;
+
+static List	   *pins_requests = NIL; /* Allocated in TopTransactionContext */
+
+static char *
+pins_table_name(void)
+{
+	Oid		nspid = get_extension_schema(get_extension_oid(MODULENAME, false));
+
+	return quote_qualified_identifier(get_namespace_name(nspid),
+									  PGM_PINS_TABLE);
+}
+
+/*
+ * Store (or remove) the pin of the statement in the pinned_modes table.
+ */
+static void
+pins_update(uint64 queryId, int status, double ref_exec_time,
+			double ref_nblocks, bool fixed)
+{
+	Oid		argtypes[4] = {INT8OID, INT4OID, FLOAT8OID, FLOAT8OID};
+	Datum	values[4];
+	char	nulls[4] = {' ', ' ', ' ', ' '};
+	char   *relname = pins_table_name();
+	int		ret;
+
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_READ_ONLY_SQL_TRANSACTION),
+				 errmsg("pinned plan cache modes can't be changed during recovery")));
+
+	values[0] = Int64GetDatum((int64) queryId);
+	values[1] = Int32GetDatum(status);
+	values[2] = Float8GetDatum(ref_exec_time);
+	values[3] = Float8GetDatum(ref_nblocks);
+	if (ref_exec_time < 0.)
+		nulls[2] = 'n';
+	if (ref_nblocks < 0.)
+		nulls[3] = 'n';
+
+	SPI_connect();
+	if (fixed)
+	{
+		ret = SPI_execute_with_args(psprintf(
+			"INSERT INTO %s (queryid, plan_cache_mode, ref_exec_time, ref_nblocks) "
+			"VALUES ($1, $2, $3, $4) ON CONFLICT (queryid) DO UPDATE SET "
+			"plan_cache_mode = EXCLUDED.plan_cache_mode, "
+			"ref_exec_time = EXCLUDED.ref_exec_time, "
+			"ref_nblocks = EXCLUDED.ref_nblocks, pinned_at = now()", relname),
+			4, argtypes, values, nulls, false, 0);
+		if (ret != SPI_OK_INSERT)
+			elog(ERROR, "failed to store the pin: %s",
+				 SPI_result_code_string(ret));
+	}
+	else
+	{
+		ret = SPI_execute_with_args(psprintf(
+			"DELETE FROM %s WHERE queryid = $1", relname),
+			1, argtypes, values, nulls, false, 0);
+		if (ret != SPI_OK_DELETE)
+			elog(ERROR, "failed to remove the pin: %s",
+				 SPI_result_code_string(ret));
+	}
+	SPI_finish();
+}
+
+static int
+pin_cmp(const void *a, const void *b)
+{
+	return pg_cmp_u64(((const PGMPin *) a)->queryid,
+					  ((const PGMPin *) b)->queryid);
+}
+
+/*
+ * Bring the shared table in accordance with the pinned_modes table: entries
+ * pinned there get fixed, other entries lose the flag. Does nothing if
+ * another backend is doing it: it will leave pins_applied behind if it
+ * started before the generation has been bumped.
+ */
+static void
+load_pins(uint64 generation)
+{
+	if (!pg_atomic_test_set_flag(&state->pins_busy))
+		return;
+
+	PG_TRY();
+	{
+		/* The previous holder of the flag could apply it already */
+		if (pg_atomic_read_u64(&state->pins_applied) < generation)
+		{
+			Relation			rel;
+			Snapshot			snapshot;
+			TableScanDesc		scan;
+			TupleTableSlot	   *slot;
+			PGMPin			   *pins;
+			int					npins = 0;
+			int					maxpins = 64;
+			dshash_seq_status	hash_seq;
+			MentorTblEntry	   *entry;
+			int					i;
+
+			pins = (PGMPin *) palloc(sizeof(PGMPin) * maxpins);
+			rel = table_open(pins_relid, AccessShareLock);
+			snapshot = RegisterSnapshot(GetLatestSnapshot());
+			scan = table_beginscan(rel, snapshot, 0, NULL);
+			slot = table_slot_create(rel, NULL);
+			while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+			{
+				PGMPin *pin;
+				bool	isnull;
+				Datum	value;
+
+				if (npins >= maxpins)
+				{
+					maxpins *= 2;
+					pins = (PGMPin *) repalloc(pins, sizeof(PGMPin) * maxpins);
+				}
+				pin = &pins[npins++];
+
+				pin->queryid = (uint64) DatumGetInt64(slot_getattr(slot, 1, &isnull));
+				pin->plan_cache_mode = DatumGetInt32(slot_getattr(slot, 2, &isnull));
+				value = slot_getattr(slot, 3, &isnull);
+				pin->ref_exec_time = isnull ? -1. : DatumGetFloat8(value);
+				value = slot_getattr(slot, 4, &isnull);
+				pin->ref_nblocks = isnull ? -1. : DatumGetFloat8(value);
+			}
+			ExecDropSingleTupleTableSlot(slot);
+			table_endscan(scan);
+			UnregisterSnapshot(snapshot);
+			table_close(rel, AccessShareLock);
+
+			qsort(pins, npins, sizeof(PGMPin), pin_cmp);
+
+			/* Unpinned in the table since the last load */
+			dshash_seq_init(&hash_seq, pgm_hash, true);
+			while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+			{
+				PGMPin	key;
+
+				key.queryid = entry->queryid;
+				if (entry->fixed &&
+					bsearch(&key, pins, npins, sizeof(PGMPin), pin_cmp) == NULL)
+				{
+					LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+					entry->fixed = false;
+					LWLockRelease(&entry->lock);
+				}
+			}
+			dshash_seq_term(&hash_seq);
+
+			for (i = 0; i < npins; i++)
+			{
+				bool	found;
+
+				entry = (MentorTblEntry *) dshash_find_or_insert(pgm_hash,
+																 &pins[i].queryid,
+																 &found);
+				if (!found)
+					entry_init(entry, 0);
+
+				LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+				entry_switch_mode(entry, pins[i].plan_cache_mode);
+				entry->fixed = true;
+				if (pins[i].ref_exec_time >= 0.)
+					entry->ref_exec_time = pins[i].ref_exec_time;
+				if (pins[i].ref_nblocks >= 0.)
+					entry->ref_nblocks = pins[i].ref_nblocks;
+				LWLockRelease(&entry->lock);
+				dshash_release_lock(pgm_hash, entry);
+			}
+			pfree(pins);
+
+			pg_atomic_write_u64(&state->pins_applied, generation);
+			move_mentor_status();
+		}
+	}
+	PG_FINALLY();
+	{
+		pg_atomic_clear_flag(&state->pins_busy);
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Re-apply the pins if the pinned_modes table has been changed.
+ *
+ * A backend bumps the generation for an invalidation only if nobody has
+ * done it since its previous check: the change is committed before the
+ * invalidation is sent, so that bump is newer than the change. A full
+ * relcache reset may hide an invalidation of the table and is treated the
+ * same way.
+ */
+static void
+check_pins(Oid extoid)
+{
+	uint64	generation;
+
+	if (unlikely(extoid != pins_extoid))
+	{
+		Oid	relid;
+
+		relid = get_relname_relid(PGM_PINS_TABLE, get_extension_schema(extoid));
+		if (!OidIsValid(relid))
+			/* Creation of the extension is in progress */
+			return;
+
+		pins_extoid = extoid;
+		pins_relid = relid;
+		pins_dirty = true;
+	}
+
+	/* Our own invalidation will be noticed after the end of transaction */
+	if (unlikely(pins_written))
+		return;
+
+	generation = pg_atomic_read_u64(&state->pins_generation);
+	if (unlikely(pins_dirty))
+	{
+		pins_dirty = false;
+		if (generation == pins_seen &&
+			pg_atomic_compare_exchange_u64(&state->pins_generation,
+										   &generation, generation + 1))
+			generation++;
+	}
+	pins_seen = generation;
+
+	if (unlikely(pg_atomic_read_u64(&state->pins_applied) < generation))
+		load_pins(generation);
+}
+
+static void
+pgm_relcache_callback(Datum arg, Oid relid)
+{
+	if (!OidIsValid(relid) || relid == pins_relid)
+		pins_dirty = true;
+	if (!OidIsValid(relid) || relid == ExtensionRelationId)
+		pgm_overrides_valid = false;
+
+	/* The extension might be created or dropped */
+	pgm_extoid_valid = false;
+}
+
+/*
+ * Trigger on the pinned_modes table: let the backends know the pins are to
+ * be re-applied once the change is committed.
+ */
+Datum
+pg_mentor_pins_changed(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"pg_mentor_pins_changed\" was not called by trigger manager")));
+
+	CacheInvalidateRelcache(trigdata->tg_relation);
+	pins_written = true;
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * Apply pin requests of the committed transaction to the shared table. It
+ * is too late to fail here, so nothing is allocated: entries are created by
+ * the request and never removed.
+ */
+static void
+pins_apply_requests(void)
+{
+	ListCell   *lc;
+
+	foreach(lc, pins_requests)
+	{
+		PGMPinRequest  *req = (PGMPinRequest *) lfirst(lc);
+
+		LWLockAcquire(&req->entry->lock, LW_EXCLUSIVE);
+		entry_set_plan_mode(req->entry, req->status, req->ref_exec_time,
+							req->ref_nblocks, req->fixed);
+		LWLockRelease(&req->entry->lock);
+		pgm_count(PGM_DECISION_MANUAL);
+	}
+	move_mentor_status();
+}
+
+/*
+ * Forget requests made in the aborted subtransaction and its children:
+ * their identifiers are not less than its own. Requests of a committed one
+ * pass to its parent.
+ */
+static void
+pgm_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					 SubTransactionId parentSubid, void *arg)
+{
+	ListCell   *lc;
+
+	if (pins_requests == NIL)
+		return;
+
+	foreach(lc, pins_requests)
+	{
+		PGMPinRequest  *req = (PGMPinRequest *) lfirst(lc);
+
+		if (req->subid < mySubid)
+			continue;
+
+		if (event == SUBXACT_EVENT_ABORT_SUB)
+			pins_requests = foreach_delete_current(pins_requests, lc);
+		else if (event == SUBXACT_EVENT_COMMIT_SUB)
+			req->subid = parentSubid;
+	}
+}
+
+Datum
+pg_mentor_set_plan_mode(PG_FUNCTION_ARGS)
+{
+	int64			queryId = PG_GETARG_INT64(0);
+	int				status = PG_GETARG_INT32(1);
+	double			ref_exec_time = PG_ARGISNULL(2) ? -1. : PG_GETARG_FLOAT8(2);
+	double			ref_nblocks = PG_ARGISNULL(3) ? -1. : PG_GETARG_FLOAT8(3);
+	bool			fixed = PG_GETARG_BOOL(4);
+	bool			found;
+	MentorTblEntry *entry;
+	bool			result = false;
+	bool			pinned;
+	MemoryContext	oldcxt;
+	PGMPinRequest  *req;
+
+	pgm_init_shmem();
+
+	entry = (MentorTblEntry *) dshash_find_or_insert(pgm_hash, &queryId, &found);
+	if (!found)
+		entry_init(entry, 0);
+	LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+	pinned = entry->fixed;
+	if (!fixed && !pinned)
+	{
+		result = pg_mentor_set_plan_mode_int(entry, status, ref_exec_time,
+											 ref_nblocks, fixed);
+		LWLockRelease(&entry->lock);
+		dshash_release_lock(pgm_hash, entry);
+		pgm_count(PGM_DECISION_MANUAL);
+		PG_RETURN_BOOL(result);
+	}
+	check_reference_data(entry, ref_exec_time, ref_nblocks);
+	LWLockRelease(&entry->lock);
+	dshash_release_lock(pgm_hash, entry);
+
+	/*
+	 * (Un)pinning: update the pinned_modes table and change the shared entry
+	 * only when the transaction commits, so that other backends never see a
+	 * pin that may be rolled back.
+	 */
+	pins_update(queryId, status, ref_exec_time, ref_nblocks, fixed);
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	req = (PGMPinRequest *) palloc(sizeof(PGMPinRequest));
+	req->entry = entry;
+	req->status = status;
+	req->ref_exec_time = ref_exec_time;
+	req->ref_nblocks = ref_nblocks;
+	req->fixed = fixed;
+	req->subid = GetCurrentSubTransactionId();
+	pins_requests = lappend(pins_requests, req);
+	MemoryContextSwitchTo(oldcxt);
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Set latency target of the statement, NULL removes it.
+ */
+Datum
+pg_mentor_set_slo(PG_FUNCTION_ARGS)
+{
+	int64			queryId = PG_GETARG_INT64(0);
+	double			slo = PG_ARGISNULL(1) ? -1. : PG_GETARG_FLOAT8(1);
+	bool			found;
+	MentorTblEntry *entry;
+
+	if (!PG_ARGISNULL(1) && slo <= 0.)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("latency target must be positive")));
+
+	pgm_init_shmem();
+
+	entry = (MentorTblEntry *) dshash_find_or_insert(pgm_hash, &queryId, &found);
+	if (!found)
+		entry_init(entry, 0);
+	LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+	entry->slo = slo;
+	entry->slo_calls[0] = entry->slo_calls[1] = 0;
+	entry->slo_violations[0] = entry->slo_violations[1] = 0;
+	LWLockRelease(&entry->lock);
+	dshash_release_lock(pgm_hash, entry);
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Per-statement planner settings.
+ *
+ * Some plans can be fixed only by a planner setting (enable_nestloop,
+ * random_page_cost, etc.). Keep a few overrides in the shared entry and
+ * apply them at a new GUC nest level around the planner call. Only settings
+ * of the query tuning group are allowed.
+ */
+
+/*
+ * Parse the chunk of settings into lists of names and values.
+ */
+static void
+settings_deserialize(const char *data, Size len, List **names, List **values)
+{
+	const char *ptr = data;
+
+	while (ptr < data + len)
+	{
+		*names = lappend(*names, pstrdup(ptr));
+		ptr += strlen(ptr) + 1;
+		*values = lappend(*values, pstrdup(ptr));
+		ptr += strlen(ptr) + 1;
+	}
+}
+
+/*
+ * Apply overrides stored for the queryId. Returns the GUC nest level to
+ * restore after planning or 0 if nothing has been set.
+ */
+static int
+apply_planner_settings(uint64 queryId)
+{
+	MentorTblEntry *entry;
+	char		   *data = NULL;
+	Size			len = 0;
+	List		   *names = NIL;
+	List		   *values = NIL;
+	ListCell	   *lc1;
+	ListCell	   *lc2;
+	int				nestlevel;
+
+	entry = (MentorTblEntry *) dshash_find(pgm_hash, &queryId, false);
+	if (entry == NULL)
+		return 0;
+
+	if (DsaPointerIsValid(entry->settings))
+	{
+		len = entry->settings_len;
+		data = palloc(len);
+		memcpy(data, dsa_get_address(dsa, entry->settings), len);
+	}
+	dshash_release_lock(pgm_hash, entry);
+
+	if (data == NULL)
+		return 0;
+
+	settings_deserialize(data, len, &names, &values);
+
+	nestlevel = NewGUCNestLevel();
+	forboth(lc1, names, lc2, values)
+	{
+		/* A broken setting shouldn't prevent the query from execution */
+		(void) set_config_option(lfirst(lc1), lfirst(lc2),
+								 PGC_USERSET, PGC_S_SESSION, GUC_ACTION_SAVE,
+								 true, WARNING, false);
+	}
+
+	return nestlevel;
+}
+
+/*
+ * Set planner setting for the statement. NULL value removes the override.
+ */
+/*
+ * Let the backends re-read the overrides flag. Overrides are changed in the
+ * shared state at once, not at commit, so the invalidation is sent at once
+ * too. It is addressed to pg_extension of the database: rebuilding that
+ * relcache entry is cheap.
+ */
+static void
+overrides_changed(void)
+{
+	SharedInvalidationMessage	msg;
+
+	msg.rc.id = SHAREDINVALRELCACHE_ID;
+	msg.rc.dbId = MyDatabaseId;
+	msg.rc.relId = ExtensionRelationId;
+	SendSharedInvalidMessages(&msg, 1);
+
+	pgm_overrides_valid = false;
+}
+
+Datum
+pg_mentor_set_planner_setting(PG_FUNCTION_ARGS)
+{
+	int64					queryId = PG_GETARG_INT64(0);
+	char				   *name = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char				   *value = PG_ARGISNULL(2) ? NULL :
+										text_to_cstring(PG_GETARG_TEXT_PP(2));
+	struct config_generic  *record;
+	MentorTblEntry		   *entry;
+	List				   *names = NIL;
+	List				   *values = NIL;
+	ListCell			   *lc1;
+	ListCell			   *lc2;
+	StringInfoData			buf;
+	int						nkept = 0;
+	bool					found;
+	bool					had_settings;
+
+	record = find_option(name, false, false, ERROR);
+	Assert(record != NULL);
+
+	if (record->group != QUERY_TUNING_METHOD &&
+		record->group != QUERY_TUNING_COST &&
+		record->group != QUERY_TUNING_GEQO &&
+		record->group != QUERY_TUNING_OTHER)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("parameter \"%s\" is not a planner setting", name)));
+
+	/* Check the value, but don't change anything */
+	if (value != NULL)
+		(void) set_config_option(record->name, value, PGC_USERSET,
+								 PGC_S_SESSION, GUC_ACTION_SET, false, ERROR,
+								 false);
+
+	pgm_init_shmem();
+
+	entry = (MentorTblEntry *) dshash_find_or_insert(pgm_hash, &queryId, &found);
+	if (!found)
+		entry_init(entry, 0);
+
+	had_settings = DsaPointerIsValid(entry->settings);
+	if (had_settings)
+		settings_deserialize(dsa_get_address(dsa, entry->settings),
+							 entry->settings_len, &names, &values);
+
+	/* Compose the new list of settings */
+	initStringInfo(&buf);
+	forboth(lc1, names, lc2, values)
+	{
+		if (strcmp(lfirst(lc1), record->name) == 0)
+			continue;
+
+		appendBinaryStringInfo(&buf, lfirst(lc1), strlen(lfirst(lc1)) + 1);
+		appendBinaryStringInfo(&buf, lfirst(lc2), strlen(lfirst(lc2)) + 1);
+		nkept++;
+	}
+	if (value != NULL)
+	{
+		if (nkept >= PGM_MAX_SETTINGS)
+		{
+			dshash_release_lock(pgm_hash, entry);
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("too many planner settings for the statement"),
+					 errdetail("At most %d settings can be overridden.",
+							   PGM_MAX_SETTINGS)));
+		}
+
+		appendBinaryStringInfo(&buf, record->name, strlen(record->name) + 1);
+		appendBinaryStringInfo(&buf, value, strlen(value) + 1);
+	}
+
+	if (had_settings)
+		dsa_free(dsa, entry->settings);
+	entry->settings = InvalidDsaPointer;
+	entry->settings_len = 0;
+
+	if (buf.len > 0)
+	{
+		entry->settings = dsa_allocate(dsa, buf.len);
+		memcpy(dsa_get_address(dsa, entry->settings), buf.data, buf.len);
+		entry->settings_len = buf.len;
+	}
+
+	if (had_settings && buf.len == 0)
+		pg_atomic_fetch_sub_u32(&state->noverrides, 1);
+	else if (!had_settings && buf.len > 0)
+		pg_atomic_fetch_add_u32(&state->noverrides, 1);
+
+	dshash_release_lock(pgm_hash, entry);
+
+	if (had_settings != (buf.len > 0))
+		overrides_changed();
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * List planner settings overridden for statements.
+ */
+Datum
+pg_mentor_show_planner_settings(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	if (pg_atomic_read_u32(&state->noverrides) == 0)
+		return (Datum) 0;
+
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		List	   *names = NIL;
+		List	   *values = NIL;
+		ListCell   *lc1;
+		ListCell   *lc2;
+
+		if (!DsaPointerIsValid(entry->settings))
+			continue;
+
+		settings_deserialize(dsa_get_address(dsa, entry->settings),
+							 entry->settings_len, &names, &values);
+		forboth(lc1, names, lc2, values)
+		{
+			Datum	vals[3] = {0};
+			bool	nulls[3] = {0};
+
+			vals[0] = Int64GetDatumFast((int64) entry->queryid);
+			vals[1] = CStringGetTextDatum(lfirst(lc1));
+			vals[2] = CStringGetTextDatum(lfirst(lc2));
+			tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+								 vals, nulls);
+		}
+	}
+	dshash_seq_term(&hash_seq);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the ring buffer size.
+ * It may contain only pgm_sample_window elements or entry->next_idx
+ * elements in case it is not full yet.
+ */
+static int
+ring_buffer_size(MentorTblEntry *entry)
+{
+	if (unlikely(ENTRY_NBLOCKS(entry)[entry->next_idx % pgm_sample_window] ==
+				 PGM_SAMPLE_EMPTY))
+		return entry->next_idx;
+	else
+		return pgm_sample_window;
+}
+
+static ArrayType *
+form_vector_int64(int64 *vector, int nrows)
+{
+	Datum	   *elems;
+	ArrayType  *a;
+	int			lbs = 1;
+	int			i;
+
+	elems = palloc(sizeof(*elems) * nrows);
+	for (i = 0; i < nrows; i++)
+		elems[i] = Int64GetDatum(vector[i]);
+	a = construct_md_array(elems, NULL, 1, &nrows, &lbs, INT8OID, 8, true, 'd');
+	return a;
+}
+
+static ArrayType *
+form_vector_dbl(double *vector, int nrows)
+{
+	Datum	   *elems;
+	ArrayType  *a;
+	int			lbs = 1;
+	int			i;
+
+	elems = palloc(sizeof(*elems) * nrows);
+	for (i = 0; i < nrows; i++)
+		elems[i] = Float8GetDatum(vector[i]);
+	a = construct_md_array(elems, NULL, 1, &nrows, &lbs, FLOAT8OID, 8, true, 'd');
+	return a;
+}
+
+/*
+ * Parameters of pg_mentor_show_prepared_statements call.
+ */
+typedef struct ShowContext
+{
+	ReturnSetInfo  *rsinfo;
+
+	/* Filters */
+	int				status;
+	int				min_samples;
+	double			min_exec_time;
+
+	/* Output options */
+	bool			with_samples;
+	int				top_n;
+	binaryheap	   *heap; /* Top-N consumers, if requested */
+
+	TimestampTz		now; /* to decay call rates to */
+} ShowContext;
+
+/*
+ * Values of an entry shown to the user. Copied under the entry lock, so they
+ * belong to one state of the entry, and never locked afterwards.
+ */
+typedef struct EntrySnapshot
+{
+	uint64		queryid;
+	uint32		refcounter;
+	int			plan_cache_mode;
+	TimestampTz	since;
+	bool		fixed;
+	int			statnum;
+	int64	   *nblocks; /* decoded samples, NULL if not requested */
+	double	   *exec_times;
+	double		avg_nblocks;
+	double		avg_exec_time;
+	double		ref_nblocks;
+	double		ref_exec_time;
+	double		plan_time;
+	int64		calls;
+	double		total_time;
+	TimestampTz	last_executed;
+	TimestampTz	last_planned;
+	double		call_rate; /* as of the moment of the copy */
+} EntrySnapshot;
+
+/*
+ * Copy the entry. Caller holds the entry lock.
+ */
+static void
+entry_snapshot(MentorTblEntry *entry, EntrySnapshot *snap, TimestampTz now,
+			   bool with_samples)
+{
+	snap->queryid = entry->queryid;
+	snap->refcounter = pg_atomic_read_u32(&entry->refcounter);
+	snap->plan_cache_mode = entry->plan_cache_mode;
+	snap->since = entry->since;
+	snap->fixed = entry->fixed;
+	snap->statnum = ring_buffer_size(entry);
+	snap->nblocks = NULL;
+	snap->exec_times = NULL;
+	if (with_samples && snap->statnum > 0)
+	{
+		snap->nblocks = palloc(sizeof(int64) * snap->statnum);
+		snap->exec_times = palloc(sizeof(double) * snap->statnum);
+		samples_decode(ENTRY_NBLOCKS(entry), snap->statnum, snap->nblocks);
+		samples_decode_time(ENTRY_TIMES(entry), snap->statnum, snap->exec_times);
+	}
+	snap->avg_nblocks = entry->avg_nblocks;
+	snap->avg_exec_time = entry->avg_exec_time;
+	snap->ref_nblocks = entry->ref_nblocks;
+	snap->ref_exec_time = entry->ref_exec_time;
+	snap->plan_time = entry->plan_time;
+	snap->calls = entry->calls;
+	snap->total_time = entry->total_time;
+	snap->last_executed = entry->last_executed;
+	snap->last_planned = entry->last_planned;
+	snap->call_rate = entry_call_rate(entry, now);
+}
+
+static void
+show_entry(ShowContext *ctx, EntrySnapshot *snap)
+{
+	Datum	values[MENTOR_TBL_ENTRY_FIELDS_NUM] = {0};
+	bool	nulls[MENTOR_TBL_ENTRY_FIELDS_NUM] = {0};
+
+	values[0] = Int64GetDatumFast((int64) snap->queryid);
+	values[1] = UInt64GetDatum(snap->refcounter);
+	values[2] = Int32GetDatum(snap->plan_cache_mode);
+	values[3] = TimestampTzGetDatum(snap->since);
+	values[4] = BoolGetDatum(snap->fixed);
+	values[5] = Int32GetDatum(snap->statnum);
+	if (snap->statnum == 0)
+	{
+		nulls[6] = nulls[7] = nulls[8] = nulls[9] = true;
+	}
+	else
+	{
+		/* Arrays are the most expensive part of the output. Skip if not needed */
+		if (snap->nblocks != NULL)
+		{
+			values[6] = PointerGetDatum(form_vector_int64(snap->nblocks,
+														  snap->statnum));
+			values[7] = PointerGetDatum(form_vector_dbl(snap->exec_times,
+														snap->statnum));
+		}
+		else
+			nulls[6] = nulls[7] = true;
+		values[8] = Float8GetDatum(snap->avg_nblocks);
+		values[9] = Float8GetDatum(snap->avg_exec_time);
+	}
+
+	if (snap->ref_nblocks > 0)
+		values[10] = Float8GetDatum(snap->ref_nblocks);
+	else
+		nulls[10] = true;
+	if (snap->ref_exec_time > 0.)
+		values[11] = Float8GetDatum(snap->ref_exec_time);
+	else
+		nulls[11] = true;
+	if (snap->plan_time >= 0.)
+		values[12] = Float8GetDatum(snap->plan_time);
+	else
+		nulls[12] = true;
+	values[13] = Int64GetDatum(snap->calls);
+	values[14] = Float8GetDatum(snap->total_time);
+	if (snap->last_executed != 0)
+		values[15] = TimestampTzGetDatum(snap->last_executed);
+	else
+		nulls[15] = true;
+	if (snap->last_planned != 0)
+		values[16] = TimestampTzGetDatum(snap->last_planned);
+	else
+		nulls[16] = true;
+	values[17] = Float8GetDatum(snap->call_rate);
+
+	tuplestore_putvalues(ctx->rsinfo->setResult, ctx->rsinfo->setDesc,
+						 values, nulls);
+}
+
+/*
+ * Comparator for the bounded heap of top consumers. The heap keeps the least
+ * consumer on the top to be replaced first.
+ */
+static int
+entry_total_time_cmp(Datum a, Datum b, void *arg)
+{
+	EntrySnapshot *ea = (EntrySnapshot *) DatumGetPointer(a);
+	EntrySnapshot *eb = (EntrySnapshot *) DatumGetPointer(b);
+
+	if (ea->total_time < eb->total_time)
+		return 1;
+	if (ea->total_time > eb->total_time)
+		return -1;
+	return 0;
+}
+
+/*
+ * Put a copy of the entry into the bounded heap if it is large enough.
+ * Caller holds the entry lock. Don't allocate the copy when the heap is
+ * full: reuse the evicted one.
+ */
+static void
+top_entries_add(binaryheap *heap, int limit, MentorTblEntry *entry,
+				TimestampTz now, bool with_samples)
+{
+	EntrySnapshot *copy;
+
+	if (heap->bh_size < limit)
+	{
+		copy = (EntrySnapshot *) palloc(sizeof(EntrySnapshot));
+		entry_snapshot(entry, copy, now, with_samples);
+		binaryheap_add(heap, PointerGetDatum(copy));
+		return;
+	}
+
+	copy = (EntrySnapshot *) DatumGetPointer(binaryheap_first(heap));
+	if (copy->total_time >= entry->total_time)
+		return;
+
+	if (copy->nblocks != NULL)
+	{
+		pfree(copy->nblocks);
+		pfree(copy->exec_times);
+	}
+	entry_snapshot(entry, copy, now, with_samples);
+	binaryheap_replace_first(heap, PointerGetDatum(copy));
+}
+
+/*
+ * Empty the heap. Returns entries in descending order of total time.
+ */
+static EntrySnapshot **
+top_entries_sorted(binaryheap *heap, int *nentries)
+{
+	EntrySnapshot **result;
+	int				i;
+
+	*nentries = heap->bh_size;
+	result = (EntrySnapshot **) palloc(sizeof(EntrySnapshot *) *
+									   Max(*nentries, 1));
+	for (i = *nentries - 1; i >= 0; i--)
+		result[i] = (EntrySnapshot *) DatumGetPointer(binaryheap_remove_first(heap));
+	return result;
+}
+
+static int
+queryid_cmp(const void *a, const void *b)
+{
+	return pg_cmp_u64(*(const uint64 *) a, *(const uint64 *) b);
+}
+
+static void
+show_process_entry(ShowContext *ctx, MentorTblEntry *entry)
+{
+	EntrySnapshot	snap;
+	bool			skip;
+
+	LWLockAcquire(&entry->lock, LW_SHARED);
+
+	/* Do we need to skip this record? */
+	skip = ((ctx->status >= 0 && ctx->status != entry->plan_cache_mode) ||
+			ring_buffer_size(entry) < ctx->min_samples ||
+			(ctx->min_exec_time > 0. &&
+			 entry->avg_exec_time < ctx->min_exec_time));
+	if (!skip)
+	{
+		if (ctx->heap != NULL)
+			top_entries_add(ctx->heap, ctx->top_n, entry, ctx->now,
+							ctx->with_samples);
+		else
+			entry_snapshot(entry, &snap, ctx->now, ctx->with_samples);
+	}
+	LWLockRelease(&entry->lock);
+
+	if (!skip && ctx->heap == NULL)
+		show_entry(ctx, &snap);
+}
+
+/*
+ * Show the state of the decision machine.
+ *
+ * Filtering is done on the server side: monitoring tools usually need a few
+ * entries of a huge table. In the top-N mode only N copies of entries are
+ * kept in memory during the scan.
+ */
+Datum
+pg_mentor_show_prepared_statements(PG_FUNCTION_ARGS)
+{
+	ShowContext			ctx;
+	MentorTblEntry	   *entry;
+
+	ctx.rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	ctx.status = PG_ARGISNULL(0) ? -1 : PG_GETARG_INT32(0);
+	ctx.min_samples = PG_ARGISNULL(2) ? 0 : PG_GETARG_INT32(2);
+	ctx.min_exec_time = PG_ARGISNULL(3) ? 0. : PG_GETARG_FLOAT8(3);
+	ctx.top_n = PG_ARGISNULL(4) ? 0 : PG_GETARG_INT32(4);
+	ctx.with_samples = PG_ARGISNULL(5) ? true : PG_GETARG_BOOL(5);
+	ctx.heap = NULL;
+	ctx.now = GetCurrentTimestamp();
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	if (ctx.top_n > 0)
+		ctx.heap = binaryheap_allocate(ctx.top_n, entry_total_time_cmp, NULL);
+
+	if (!PG_ARGISNULL(1))
+	{
+		ArrayType  *queryids = PG_GETARG_ARRAYTYPE_P(1);
+		Datum	   *elems;
+		bool	   *elnulls;
+		int			nelems;
+		uint64	   *keys;
+		int			nkeys = 0;
+		int			i;
+
+		/*
+		 * Look up the entries directly instead of the full scan. Each entry
+		 * is shown once, even if its queryId is repeated in the array.
+		 */
+		deconstruct_array_builtin(queryids, INT8OID, &elems, &elnulls, &nelems);
+		keys = (uint64 *) palloc(sizeof(uint64) * Max(nelems, 1));
+		for (i = 0; i < nelems; i++)
+		{
+			if (!elnulls[i])
+				keys[nkeys++] = (uint64) DatumGetInt64(elems[i]);
+		}
+		qsort(keys, nkeys, sizeof(uint64), queryid_cmp);
+		nkeys = qunique(keys, nkeys, sizeof(uint64), queryid_cmp);
+
+		for (i = 0; i < nkeys; i++)
+		{
+			entry = (MentorTblEntry *) dshash_find(pgm_hash, &keys[i], false);
+			if (entry == NULL)
+				continue;
+
+			show_process_entry(&ctx, entry);
+			dshash_release_lock(pgm_hash, entry);
+		}
+	}
+	else
+	{
+		dshash_seq_status	hash_seq;
+
+		dshash_seq_init(&hash_seq, pgm_hash, false);
+		while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+			show_process_entry(&ctx, entry);
+		dshash_seq_term(&hash_seq);
+	}
+
+	if (ctx.heap != NULL)
+	{
+		EntrySnapshot **entries;
+		int				nentries;
+		int				i;
+
+		entries = top_entries_sorted(ctx.heap, &nentries);
+		for (i = 0; i < nentries; i++)
+			show_entry(&ctx, entries[i]);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Show average time spent in each executor phase, separately for generic and
+ * custom plans.
+ */
+Datum
+pg_mentor_show_exec_phases(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		PGMPhaseStats	all_phases[PGM_PLAN_KINDS];
+		int				kind;
+
+		LWLockAcquire(&entry->lock, LW_SHARED);
+		memcpy(all_phases, entry->phases, sizeof(all_phases));
+		LWLockRelease(&entry->lock);
+
+		for (kind = 0; kind < PGM_PLAN_KINDS; kind++)
+		{
+			PGMPhaseStats  *phases = &all_phases[kind];
+			Datum			values[6 + PGM_PHASES_NUM] = {0};
+			bool			nulls[6 + PGM_PHASES_NUM] = {0};
+			double			exec_time;
+			int				i;
+
+			if (phases->nexecs == 0)
+				continue;
+
+			values[0] = Int64GetDatumFast((int64) entry->queryid);
+			values[1] = CStringGetTextDatum(plan_kind_names[kind]);
+			values[2] = Int64GetDatum(phases->nexecs);
+			for (i = 0; i < PGM_PHASES_NUM; i++)
+				values[3 + i] = Float8GetDatum(phases->time[i] / phases->nexecs);
+
+			/* Per-row cost doesn't depend on the size of the result */
+			exec_time = phases->time[PGM_PHASE_RUN] +
+						phases->time[PGM_PHASE_FINISH];
+			values[3 + PGM_PHASES_NUM] = Int64GetDatum(phases->rows);
+			if (phases->rows > 0)
+			{
+				values[4 + PGM_PHASES_NUM] =
+					Float8GetDatum(exec_time / phases->rows);
+				values[5 + PGM_PHASES_NUM] =
+					Float8GetDatum((double) phases->nblocks / phases->rows);
+			}
+			else
+				nulls[4 + PGM_PHASES_NUM] = nulls[5 + PGM_PHASES_NUM] = true;
+
+			tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+								 values, nulls);
+		}
+	}
+	dshash_seq_term(&hash_seq);
+
+	return (Datum) 0;
+}
+
+/*
+ * SLO compliance of statements with a latency target, before and after the
+ * last switch of the plan mode.
+ */
+Datum
+pg_mentor_slo_report(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		Datum	values[12] = {0};
+		bool	nulls[12] = {0};
+		int		statnum;
+		int		kind;
+		int		i;
+
+		if (entry->slo <= 0.)
+			continue;
+
+		LWLockAcquire(&entry->lock, LW_SHARED);
+		statnum = ring_buffer_size(entry);
+		values[0] = Int64GetDatumFast((int64) entry->queryid);
+		values[1] = Float8GetDatum(entry->slo);
+		values[2] = Int32GetDatum(entry->plan_cache_mode);
+
+		for (kind = 0; kind < PGM_PLAN_KINDS; kind++)
+		{
+			double p99 = (statnum > 0) ? latency_p99(entry, statnum, kind) : -1.;
+
+			if (p99 >= 0.)
+				values[3 + kind] = Float8GetDatum(p99);
+			else
+				nulls[3 + kind] = true;
+		}
+
+		if (entry->switched_at != 0)
+			values[5] = TimestampTzGetDatum(entry->switched_at);
+		else
+			nulls[5] = true;
+
+		for (i = 0; i < 2; i++)
+		{
+			values[6 + i * 3] = Int64GetDatum(entry->slo_calls[i]);
+			values[7 + i * 3] = Int64GetDatum(entry->slo_violations[i]);
+			if (entry->slo_calls[i] > 0)
+				values[8 + i * 3] = Float8GetDatum(1. -
+					(double) entry->slo_violations[i] / entry->slo_calls[i]);
+			else
+				nulls[8 + i * 3] = true;
+		}
+		LWLockRelease(&entry->lock);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+							 values, nulls);
+	}
+	dshash_seq_term(&hash_seq);
+
+	return (Datum) 0;
+}
+
+/*
+ * Report statements that are prepared and deallocated over and over again.
+ *
+ * Each DEALLOCATE followed by one more PREPARE of the same statement repeats
+ * parse analysis and rewriting for nothing: count it as a wasted time.
+ */
+Datum
+pg_mentor_prepare_churn(PG_FUNCTION_ARGS)
+{
+	int64				min_prepares = PG_GETARG_INT64(0);
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+	TimestampTz			now = GetCurrentTimestamp();
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		Datum	values[8] = {0};
+		bool	nulls[8] = {0};
+		double	avg_prepare_time;
+		double	seconds;
+		int64	prepares = pg_atomic_read_u64(&entry->prepares);
+		int64	deallocates = pg_atomic_read_u64(&entry->deallocates);
+		int64	repeated;
+
+		if (prepares < Max(min_prepares, 1))
+			continue;
+
+		avg_prepare_time = (double) pg_atomic_read_u64(&entry->prepare_time) /
+			NS_PER_MS / prepares;
+		repeated = Min(deallocates, prepares - 1);
+		seconds = (double) (now - entry->stats_since) / USECS_PER_SEC;
+
+		values[0] = Int64GetDatumFast((int64) entry->queryid);
+		values[1] = Int64GetDatum(prepares);
+		values[2] = Int64GetDatum(deallocates);
+		values[3] = Int64GetDatum(entry->calls);
+		if (seconds > 0.)
+			values[4] = Float8GetDatum(prepares / seconds);
+		else
+			nulls[4] = true;
+		if (entry->calls > 0)
+			values[5] = Float8GetDatum((double) prepares / entry->calls);
+		else
+			nulls[5] = true;
+		values[6] = Float8GetDatum(avg_prepare_time);
+		values[7] = Float8GetDatum(avg_prepare_time * repeated);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+	dshash_seq_term(&hash_seq);
+
+	return (Datum) 0;
+}
+
+/*
+ * Serialize bound parameters into the buffer, as much as fits: the type Oid
+ * of each one followed by its datumSerialize()d value. Returns false if some
+ * parameters didn't fit.
+ */
+static bool
+params_serialize(ParamListInfo params, char *buf, Size size, int *nparams,
+				 Size *len)
+{
+	char   *ptr = buf;
+	int		i;
+
+	*nparams = 0;
+	*len = 0;
+
+	if (params == NULL)
+		return true;
+
+	/* Values of dynamic parameters aren't known in advance */
+	if (params->paramFetch != NULL)
+		return (params->numParams == 0);
+
+	for (i = 0; i < params->numParams; i++)
+	{
+		ParamExternData *prm = &params->params[i];
+		Oid				ptype = prm->ptype;
+		bool			isnull = prm->isnull || !OidIsValid(ptype);
+		int16			typlen = sizeof(Datum);
+		bool			typbyval = true;
+		Size			datum_size;
+
+		if (!isnull)
+			get_typlenbyval(ptype, &typlen, &typbyval);
+
+		datum_size = sizeof(Oid) +
+			datumEstimateSpace(prm->value, isnull, typbyval, typlen);
+		if (*len + datum_size > size)
+			return false;
+
+		memcpy(ptr, &ptype, sizeof(Oid));
+		ptr += sizeof(Oid);
+		datumSerialize(prm->value, isnull, typbyval, typlen, &ptr);
+		*len = ptr - buf;
+		(*nparams)++;
+	}
+	return true;
+}
+
+/*
+ * Put the execution into the shared buffer, replacing the oldest record.
+ */
+static void
+outlier_capture(uint64 queryId, PGMPlanKind plan_kind, double exec_time,
+				double threshold, int64 nblocks, ParamListInfo params)
+{
+	PGMOutlier	   *rec = palloc(sizeof(PGMOutlier));
+	PGMOutlier	   *buffer;
+
+	rec->queryid = queryId;
+	rec->plan_kind = plan_kind;
+	rec->captured_at = GetCurrentTimestamp();
+	rec->exec_time = exec_time;
+	rec->threshold = threshold;
+	rec->nblocks = nblocks;
+
+	/* Catalog lookups and copying are done before taking the lock */
+	rec->truncated = !params_serialize(params, rec->params,
+									   PGM_OUTLIER_PARAMS_SIZE, &rec->nparams,
+									   &rec->params_len);
+
+	LWLockAcquire(&state->outliers_lock, LW_EXCLUSIVE);
+	if (!DsaPointerIsValid(state->outliers))
+		state->outliers = dsa_allocate0(dsa,
+										sizeof(PGMOutlier) * PGM_OUTLIERS_NUM);
+	buffer = (PGMOutlier *) dsa_get_address(dsa, state->outliers);
+	memcpy(&buffer[state->outliers_next % PGM_OUTLIERS_NUM], rec,
+		   offsetof(PGMOutlier, params) + rec->params_len);
+	state->outliers_next++;
+	LWLockRelease(&state->outliers_lock);
+
+	pfree(rec);
+}
+
+static char *
+outlier_render_params(PGMOutlier *rec)
+{
+	StringInfoData	buf;
+	char		   *ptr = rec->params;
+	int				i;
+
+	initStringInfo(&buf);
+	for (i = 0; i < rec->nparams; i++)
+	{
+		Oid		ptype;
+		bool	isnull;
+		Datum	value;
+
+		memcpy(&ptype, ptr, sizeof(Oid));
+		ptr += sizeof(Oid);
+		value = datumRestore(&ptr, &isnull);
+
+		if (i > 0)
+			appendStringInfoString(&buf, ", ");
+		appendStringInfo(&buf, "$%d = ", i + 1);
+		if (isnull)
+			appendStringInfoString(&buf, "NULL");
+		else
+		{
+			Oid		typoutput;
+			bool	typisvarlena;
+
+			getTypeOutputInfo(ptype, &typoutput, &typisvarlena);
+			appendStringInfoString(&buf,
+				quote_literal_cstr(OidOutputFunctionCall(typoutput, value)));
+		}
+	}
+	if (rec->truncated)
+		appendStringInfoString(&buf, (rec->nparams > 0) ? ", ..." : "...");
+
+	return buf.data;
+}
+
+/*
+ * Captured outlier executions, the oldest first.
+ */
+Datum
+pg_mentor_show_outliers(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	PGMOutlier	   *records;
+	int				nrecords = 0;
+	int				i;
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	/* Copy the buffer: rendering of values may take a while */
+	records = (PGMOutlier *) palloc(sizeof(PGMOutlier) * PGM_OUTLIERS_NUM);
+	LWLockAcquire(&state->outliers_lock, LW_SHARED);
+	if (DsaPointerIsValid(state->outliers))
+	{
+		PGMOutlier *buffer = dsa_get_address(dsa, state->outliers);
+		uint64		first = 0;
+		uint64		n;
+
+		if (state->outliers_next > PGM_OUTLIERS_NUM)
+			first = state->outliers_next - PGM_OUTLIERS_NUM;
+		for (n = first; n < state->outliers_next; n++)
+			memcpy(&records[nrecords++], &buffer[n % PGM_OUTLIERS_NUM],
+				   sizeof(PGMOutlier));
+	}
+	LWLockRelease(&state->outliers_lock);
+
+	for (i = 0; i < nrecords; i++)
+	{
+		Datum	values[7] = {0};
+		bool	nulls[7] = {0};
+
+		values[0] = Int64GetDatumFast((int64) records[i].queryid);
+		values[1] = CStringGetTextDatum(plan_kind_names[records[i].plan_kind]);
+		values[2] = TimestampTzGetDatum(records[i].captured_at);
+		values[3] = Float8GetDatum(records[i].exec_time);
+		values[4] = Float8GetDatum(records[i].threshold);
+		values[5] = Int64GetDatum(records[i].nblocks);
+		values[6] = CStringGetTextDatum(outlier_render_params(&records[i]));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Append an OpenMetrics family header.
+ */
+static void
+metrics_family(StringInfo buf, const char *name, const char *type,
+			   const char *help)
+{
+	appendStringInfo(buf, "# TYPE %s %s\n", name, type);
+	appendStringInfo(buf, "# HELP %s %s\n", name, help);
+}
+
+/*
+ * Export state of the extension in the OpenMetrics text format.
+ *
+ * Aggregated counters go first, then gauges for the top_k statements with
+ * the largest total execution time. Everything is gathered in one scan of
+ * the shared table.
+ */
+Datum
+pg_mentor_metrics(PG_FUNCTION_ARGS)
+{
+	int					top_k = PG_GETARG_INT32(0);
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+	int64				nentries[lengthof(plan_mode_names)] = {0};
+	int64				nfixed = 0;
+	binaryheap		   *heap = NULL;
+	EntrySnapshot	  **top = NULL;
+	int					ntop = 0;
+	StringInfoData		buf;
+	TimestampTz			now = GetCurrentTimestamp();
+	int					i;
+
+	pgm_init_shmem();
+
+	if (top_k > 0)
+		heap = binaryheap_allocate(top_k, entry_total_time_cmp, NULL);
+
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		if (entry->plan_cache_mode >= 0 &&
+			entry->plan_cache_mode < lengthof(plan_mode_names))
+			nentries[entry->plan_cache_mode]++;
+		if (entry->fixed)
+			nfixed++;
+
+		if (heap != NULL)
+		{
+			LWLockAcquire(&entry->lock, LW_SHARED);
+			top_entries_add(heap, top_k, entry, now, false);
+			LWLockRelease(&entry->lock);
+		}
+	}
+	dshash_seq_term(&hash_seq);
+
+	if (heap != NULL)
+		top = top_entries_sorted(heap, &ntop);
+
+	initStringInfo(&buf);
+
+	metrics_family(&buf, "pg_mentor_entries", "gauge",
+				   "Number of tracked statements by plan cache mode.");
+	for (i = 0; i < lengthof(plan_mode_names); i++)
+		appendStringInfo(&buf, "pg_mentor_entries{mode=\"%s\"} " INT64_FORMAT "\n",
+						 plan_mode_names[i], nentries[i]);
+
+	metrics_family(&buf, "pg_mentor_fixed_entries", "gauge",
+				   "Number of statements with fixed plan cache mode.");
+	appendStringInfo(&buf, "pg_mentor_fixed_entries " INT64_FORMAT "\n", nfixed);
+
+	metrics_family(&buf, "pg_mentor_decisions", "counter",
+				   "Plan cache mode switches by rule.");
+	for (i = 0; i < PGM_DECISIONS_NUM; i++)
+		appendStringInfo(&buf, "pg_mentor_decisions_total{rule=\"%s\"} " UINT64_FORMAT "\n",
+						 decision_names[i],
+						 pg_atomic_read_u64(&state->counters[i]));
+
+	metrics_family(&buf, "pg_mentor_reconsider_runs", "counter",
+				   "Number of strategy runs.");
+	appendStringInfo(&buf, "pg_mentor_reconsider_runs_total " UINT64_FORMAT "\n",
+					 pg_atomic_read_u64(&state->counters[PGM_COUNTER_RECONSIDER]));
+
+	metrics_family(&buf, "pg_mentor_check_state_runs", "counter",
+				   "Number of plan mode refreshes made by backends.");
+	appendStringInfo(&buf, "pg_mentor_check_state_runs_total " UINT64_FORMAT "\n",
+					 pg_atomic_read_u64(&state->counters[PGM_COUNTER_CHECK_STATE]));
+
+	metrics_family(&buf, "pg_mentor_resets", "counter",
+				   "Number of the table resets.");
+	appendStringInfo(&buf, "pg_mentor_resets_total " UINT64_FORMAT "\n",
+					 pg_atomic_read_u64(&state->counters[PGM_COUNTER_RESET]));
+
+	metrics_family(&buf, "pg_mentor_registration_flushes", "counter",
+				   "Number of batches of prepared statement registrations reported by backends.");
+	appendStringInfo(&buf, "pg_mentor_registration_flushes_total " UINT64_FORMAT "\n",
+					 pg_atomic_read_u64(&state->counters[PGM_COUNTER_FLUSH]));
+
+	metrics_family(&buf, "pg_mentor_generation", "gauge",
+				   "Generation of the decisions state.");
+	appendStringInfo(&buf, "pg_mentor_generation " UINT64_FORMAT "\n",
+					 pg_atomic_read_u64(&state->state_decisions));
+
+	if (ntop > 0)
+	{
+		metrics_family(&buf, "pg_mentor_statement_calls", "counter",
+					   "Executions of the statement since the last reset.");
+		for (i = 0; i < ntop; i++)
+			appendStringInfo(&buf, "pg_mentor_statement_calls_total{queryid=\"" INT64_FORMAT "\"} " INT64_FORMAT "\n",
+							 (int64) top[i]->queryid, top[i]->calls);
+
+		metrics_family(&buf, "pg_mentor_statement_exec_time_ms", "counter",
+					   "Total execution time of the statement since the last reset.");
+		for (i = 0; i < ntop; i++)
+			appendStringInfo(&buf, "pg_mentor_statement_exec_time_ms_total{queryid=\"" INT64_FORMAT "\"} %.3f\n",
+							 (int64) top[i]->queryid, top[i]->total_time);
+
+		metrics_family(&buf, "pg_mentor_statement_avg_exec_time_ms", "gauge",
+					   "Average execution time over the sample window.");
+		for (i = 0; i < ntop; i++)
+			appendStringInfo(&buf, "pg_mentor_statement_avg_exec_time_ms{queryid=\"" INT64_FORMAT "\"} %.3f\n",
+							 (int64) top[i]->queryid, top[i]->avg_exec_time);
+
+		metrics_family(&buf, "pg_mentor_statement_plan_time_ms", "gauge",
+					   "The last planning time of the statement.");
+		for (i = 0; i < ntop; i++)
+			appendStringInfo(&buf, "pg_mentor_statement_plan_time_ms{queryid=\"" INT64_FORMAT "\"} %.3f\n",
+							 (int64) top[i]->queryid, Max(top[i]->plan_time, 0.));
+
+		metrics_family(&buf, "pg_mentor_statement_call_rate", "gauge",
+					   "Executions per second, exponentially decayed over a minute.");
+		for (i = 0; i < ntop; i++)
+			appendStringInfo(&buf, "pg_mentor_statement_call_rate{queryid=\"" INT64_FORMAT "\"} %.3f\n",
+							 (int64) top[i]->queryid, top[i]->call_rate);
+
+		metrics_family(&buf, "pg_mentor_statement_plan_cache_mode", "gauge",
+					   "Plan cache mode: 0 - auto, 1 - force generic, 2 - force custom.");
+		for (i = 0; i < ntop; i++)
+			appendStringInfo(&buf, "pg_mentor_statement_plan_cache_mode{queryid=\"" INT64_FORMAT "\"} %d\n",
+							 (int64) top[i]->queryid, top[i]->plan_cache_mode);
+	}
+
+	appendStringInfoString(&buf, "# EOF\n");
+
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
+}
+
+#include "math.h"
+
+static double
+calculateStandardDeviation(int N, int64 data[])
+{
+    double	sum = 0;
+	double	mean;
+	double	values = 0;
+
+    for (int i = 0; i < N; i++)
+	{
+        sum += data[i];
+    }
+
+    mean = sum / N;
+    for (int i = 0; i < N; i++)
+	{
+        values += pow(data[i] - mean, 2);
+    }
+
+    return sqrt(values / N);
+}
+
+/*
+ * Coefficient of variation of blocks read per processed row.
+ *
+ * A statement whose parameters select one row or a hundred thousand rows
+ * shows a huge spread of nblocks even if each row costs the same under any
+ * plan. Normalised by the result size, the spread shows plan quality only.
+ * Statements returning no rows are counted as returning one.
+ */
+static double
+per_row_variation(int N, int64 nblocks[], int64 rows[])
+{
+	double	sum = 0.;
+	double	mean;
+	double	values = 0.;
+	int		i;
+
+	for (i = 0; i < N; i++)
+		sum += (double) nblocks[i] / Max(rows[i], 1);
+
+	mean = sum / N;
+	if (mean <= 0.)
+		return 0.;
+
+	for (i = 0; i < N; i++)
+		values += pow((double) nblocks[i] / Max(rows[i], 1) - mean, 2);
+
+	return sqrt(values / N) / mean;
+}
+
+/*
+ * How much longer ExecutorStart of the generic plan takes than of the custom
+ * one, ms. Returns -1 if there are not enough executions of both kinds.
+ */
+static double
+generic_startup_overhead(MentorTblEntry *entry)
+{
+	PGMPhaseStats  *generic = &entry->phases[PGM_PLAN_GENERIC];
+	PGMPhaseStats  *custom = &entry->phases[PGM_PLAN_CUSTOM];
+
+	if (generic->nexecs < 2 || custom->nexecs < 1)
+		return -1.;
+
+	return generic->time[PGM_PHASE_START] / generic->nexecs -
+		   custom->time[PGM_PHASE_START] / custom->nexecs;
+}
+
+/*
+ * Statistical tests.
+ *
+ * The ring buffer holds a few samples only, so a point estimate is easily
+ * driven by noise. Before switching, check that the difference the rule is
+ * based on is significant: one-sample t-test against the threshold of the
+ * rule, or Welch's t-test between samples of generic and custom plans if the
+ * window contains both.
+ */
+
+/*
+ * Continued fraction for the incomplete beta function (modified Lentz's
+ * method).
+ */
+static double
+incomplete_beta_cf(double a, double b, double x)
+{
+	const double	eps = 1e-12;
+	const double	fpmin = 1e-300;
+	double			qab = a + b;
+	double			qap = a + 1.;
+	double			qam = a - 1.;
+	double			c = 1.;
+	double			d = 1. - qab * x / qap;
+	double			h;
+	int				m;
+
+	if (fabs(d) < fpmin)
+		d = fpmin;
+	d = 1. / d;
+	h = d;
+
+	for (m = 1; m <= 300; m++)
+	{
+		int		m2 = 2 * m;
+		double	aa;
+		double	del;
+
+		aa = m * (b - m) * x / ((qam + m2) * (a + m2));
+		d = 1. + aa * d;
+		if (fabs(d) < fpmin)
+			d = fpmin;
+		c = 1. + aa / c;
+		if (fabs(c) < fpmin)
+			c = fpmin;
+		d = 1. / d;
+		h *= d * c;
+
+		aa = -(a + m) * (qab + m) * x / ((a + m2) * (qap + m2));
+		d = 1. + aa * d;
+		if (fabs(d) < fpmin)
+			d = fpmin;
+		c = 1. + aa / c;
+		if (fabs(c) < fpmin)
+			c = fpmin;
+		d = 1. / d;
+		del = d * c;
+		h *= del;
+
+		if (fabs(del - 1.) < eps)
+			break;
+	}
+	return h;
+}
+
+/*
+ * Regularised incomplete beta function I_x(a, b).
+ */
+static double
+incomplete_beta(double a, double b, double x)
+{
+	double	bt;
+
+	if (x <= 0.)
+		return 0.;
+	if (x >= 1.)
+		return 1.;
+
+	bt = exp(lgamma(a + b) - lgamma(a) - lgamma(b) +
+			 a * log(x) + b * log(1. - x));
+
+	if (x < (a + 1.) / (a + b + 2.))
+		return bt * incomplete_beta_cf(a, b, x) / a;
+	else
+		return 1. - bt * incomplete_beta_cf(b, a, 1. - x) / b;
+}
+
+/*
+ * P(T > t) for Student's t-distribution with df degrees of freedom.
+ */
+static double
+student_t_sf(double t, double df)
+{
+	double	tail = 0.5 * incomplete_beta(df / 2., 0.5, df / (df + t * t));
+
+	return (t >= 0.) ? tail : 1. - tail;
+}
+
+/*
+ * Critical value t such that P(T > t) = 1 - p, p in [0.5, 1).
+ */
+static double
+student_t_quantile(double p, double df)
+{
+	double	lo = 0.;
+	double	hi = 1000.;
+	int		i;
+
+	for (i = 0; i < 100; i++)
+	{
+		double mid = (lo + hi) / 2.;
+
+		if (student_t_sf(mid, df) > 1. - p)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo + hi) / 2.;
+}
+
+static void
+sample_mean_var(double *x, int n, double *mean, double *var)
+{
+	double	sum = 0.;
+	double	ss = 0.;
+	int		i;
+
+	for (i = 0; i < n; i++)
+		sum += x[i];
+	*mean = sum / n;
+	for (i = 0; i < n; i++)
+		ss += (x[i] - *mean) * (x[i] - *mean);
+	*var = (n > 1) ? ss / (n - 1) : 0.;
+}
+
+/*
+ * Result of the test backing a decision, reported by pg_mentor_reconsider().
+ */
+typedef struct PGMTestResult
+{
+	const char *metric;
+	double		mean; /* sample mean or difference of means (Welch) */
+	double		reference; /* threshold of the rule */
+	double		ci_low;
+	double		ci_high;
+	double		pvalue;
+} PGMTestResult;
+
+/*
+ * One-sided one-sample t-test of "mean > ref" (greater) or "mean < ref".
+ * Also computes the two-sided confidence interval of the mean.
+ */
+static void
+one_sample_test(double *x, int n, double ref, bool greater,
+				PGMTestResult *res)
+{
+	double	var;
+	double	se;
+	double	q;
+
+	sample_mean_var(x, n, &res->mean, &var);
+	res->reference = ref;
+	se = sqrt(var / n);
+
+	if (se <= 0.)
+	{
+		/* All the samples are equal: the answer is exact */
+		res->ci_low = res->ci_high = res->mean;
+		res->pvalue = ((greater && res->mean > ref) ||
+					   (!greater && res->mean < ref)) ? 0. : 1.;
+		return;
+	}
+
+	q = student_t_quantile((1. + pgm_ci_level()) / 2., n - 1);
+	res->ci_low = res->mean - q * se;
+	res->ci_high = res->mean + q * se;
+	res->pvalue = student_t_sf(greater ? (res->mean - ref) / se :
+										 (ref - res->mean) / se, n - 1);
+}
+
+/*
+ * One-sided Welch's t-test of "mean(x1) > mean(x2)". The interval is built
+ * for the difference of means.
+ */
+static void
+welch_test(double *x1, int n1, double *x2, int n2, PGMTestResult *res)
+{
+	double	m1, m2, v1, v2;
+	double	s1, s2;
+	double	se;
+	double	df;
+	double	q;
+
+	sample_mean_var(x1, n1, &m1, &v1);
+	sample_mean_var(x2, n2, &m2, &v2);
+	s1 = v1 / n1;
+	s2 = v2 / n2;
+	se = sqrt(s1 + s2);
+
+	res->mean = m1 - m2;
+	res->reference = 0.;
+
+	if (se <= 0.)
+	{
+		res->ci_low = res->ci_high = res->mean;
+		res->pvalue = (res->mean > 0.) ? 0. : 1.;
+		return;
+	}
+
+	df = (s1 + s2) * (s1 + s2) /
+		 (s1 * s1 / (n1 - 1) + s2 * s2 / (n2 - 1));
+	q = student_t_quantile((1. + pgm_ci_level()) / 2., df);
+	res->ci_low = res->mean - q * se;
+	res->ci_high = res->mean + q * se;
+	res->pvalue = student_t_sf(res->mean / se, df);
+}
+
+/*
+ * Is the test result good enough to act on it?
+ */
+static bool
+significant(PGMTestResult *res)
+{
+	if (pgm_confidence_level <= 0.)
+		return true;
+
+	return res->pvalue >= 0. && res->pvalue <= 1. - pgm_confidence_level;
+}
+
+/*
+ * Copy samples of the entry into a plain array. With kind >= 0 only samples
+ * of that plan kind are collected.
+ */
+static int
+entry_samples(MentorTblEntry *entry, int statnum, bool blocks, int kind,
+			  double *x)
+{
+	int n = 0;
+	int i;
+
+	for (i = 0; i < statnum; i++)
+	{
+		if (kind >= 0 && sample_kind(entry, i) != kind)
+			continue;
+		x[n++] = blocks ? (double) sample_decode(ENTRY_NBLOCKS(entry)[i]) :
+						  sample_decode_time(ENTRY_TIMES(entry)[i]);
+	}
+	return n;
+}
+
+/*
+ * Test the metric of the entry against the threshold.
+ */
+static bool
+confident(MentorTblEntry *entry, int statnum, bool blocks, double ref,
+		  bool greater, PGMTestResult *res)
+{
+	double *x = palloc(sizeof(double) * statnum);
+
+	entry_samples(entry, statnum, blocks, -1, x);
+	res->metric = blocks ? "nblocks" : "exec_time";
+	one_sample_test(x, statnum, ref, greater, res);
+	pfree(x);
+	return significant(res);
+}
+
+/*
+ * Are executions of the worse plan kind slower than of the other one? Falls
+ * back to the one-sample test of nblocks against the reference if the window
+ * doesn't contain enough samples of both kinds.
+ */
+static bool
+confident_worse(MentorTblEntry *entry, int statnum, PGMPlanKind worse,
+				double ref_nblocks, PGMTestResult *res)
+{
+	double *x1 = palloc(sizeof(double) * statnum);
+	double *x2 = palloc(sizeof(double) * statnum);
+	int		n1;
+	int		n2;
+	bool	result;
+
+	n1 = entry_samples(entry, statnum, false, worse, x1);
+	n2 = entry_samples(entry, statnum, false,
+					   worse == PGM_PLAN_GENERIC ? PGM_PLAN_CUSTOM :
+												   PGM_PLAN_GENERIC, x2);
+
+	if (n1 >= 2 && n2 >= 2)
+	{
+		res->metric = "exec_time_diff";
+		welch_test(x1, n1, x2, n2, res);
+		result = significant(res);
+	}
+	else
+		result = confident(entry, statnum, true, ref_nblocks, true, res);
+
+	pfree(x1);
+	pfree(x2);
+	return result;
+}
+
+static int
+dbl_cmp(const void *a, const void *b)
+{
+	double da = *(const double *) a;
+	double db = *(const double *) b;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * Execution time percentile (0-100) over the full ring buffer.
+ */
+static double
+ring_time_percentile(MentorTblEntry *entry, double percentile)
+{
+	double *times = palloc(sizeof(double) * pgm_sample_window);
+	int		idx;
+	double	result;
+
+	samples_decode_time(ENTRY_TIMES(entry), pgm_sample_window, times);
+	qsort(times, pgm_sample_window, sizeof(double), dbl_cmp);
+	idx = (int) ceil(percentile / 100. * pgm_sample_window) - 1;
+	result = times[Max(Min(idx, pgm_sample_window - 1), 0)];
+	pfree(times);
+	return result;
+}
+
+/*
+ * Estimate 99th percentile of latency (execution plus planning, if each
+ * execution builds a plan) over samples of the plan kind, -1 for any kind.
+ * Returns -1 if there are less than pg_mentor.min_samples of them. With a
+ * small window the estimate tends to the maximum, which is the safe side.
+ */
+static double
+latency_p99(MentorTblEntry *entry, int statnum, int kind)
+{
+	double *x = palloc(sizeof(double) * statnum);
+	double	plan_time = Max(entry->plan_time, 0.);
+	double	pos;
+	double	result;
+	int		n = 0;
+	int		i;
+
+	for (i = 0; i < statnum; i++)
+	{
+		if (kind >= 0 && sample_kind(entry, i) != kind)
+			continue;
+		x[n++] = sample_decode_time(ENTRY_TIMES(entry)[i]) +
+				 (sample_kind(entry, i) == PGM_PLAN_CUSTOM ? plan_time : 0.);
+	}
+
+	if (n < pgm_min_samples)
+	{
+		pfree(x);
+		return -1.;
+	}
+
+	qsort(x, n, sizeof(double), dbl_cmp);
+	pos = 0.99 * (n - 1);
+	i = (int) pos;
+	result = (i + 1 < n) ? x[i] + (pos - i) * (x[i + 1] - x[i]) : x[i];
+	pfree(x);
+	return result;
+}
+
+/*
+ * Latency-SLO strategy: choose the plan mode minimising the p99 latency
+ * estimate. Statements meeting their SLO within the margin are left alone:
+ * a switch may push them over it. A statement violating its SLO without
+ * samples of the other plan kind is switched to collect them.
+ */
+static int
+reconsider_slo(MentorTblEntry *entry, int statnum, PGMTestResult *res)
+{
+	double	p99[3];
+	int		best;
+	int		mode;
+
+	if (entry->fixed)
+		return -1;
+
+	p99[0] = latency_p99(entry, statnum, -1);
+	p99[1] = latency_p99(entry, statnum, PGM_PLAN_GENERIC);
+	p99[2] = latency_p99(entry, statnum, PGM_PLAN_CUSTOM);
+
+	/* Current mode must be measured to be compared */
+	if (p99[entry->plan_cache_mode] < 0.)
+		return -1;
+
+	/* Compliant and close to the target: prefer stability */
+	if (p99[entry->plan_cache_mode] <= entry->slo &&
+		p99[entry->plan_cache_mode] > entry->slo * (1. - pgm_slo_margin))
+		return -1;
+
+	best = entry->plan_cache_mode;
+	for (mode = 1; mode <= 2; mode++)
+	{
+		if (p99[mode] >= 0. &&
+			p99[mode] * (1. + pgm_slo_margin) < p99[best])
+			best = mode;
+	}
+
+	/* Nothing to compare with yet: explore the other mode */
+	if (best == entry->plan_cache_mode &&
+		p99[entry->plan_cache_mode] > entry->slo)
+	{
+		if (entry->plan_cache_mode != 2 && p99[2] < 0.)
+			best = 2;
+		else if (entry->plan_cache_mode != 1 && p99[1] < 0.)
+			best = 1;
+	}
+
+	if (best == entry->plan_cache_mode)
+		return -1;
+
+	res->metric = "p99_latency";
+	res->mean = p99[best];
+	res->reference = entry->slo;
+	res->ci_low = res->ci_high = p99[entry->plan_cache_mode];
+	res->pvalue = -1.;
+
+	pg_mentor_set_plan_mode_int(entry, best, -1, -1, false);
+	return PGM_DECISION_SLO;
+}
+
+/*
+ * Shape fingerprint of a prepared statement: its analysed tree with relation
+ * identity removed. The query jumble includes relation OIDs, so copies of
+ * the same statement over tables of different schemas get different
+ * queryIds; they share the shape.
+ */
+static bool
+shape_walker(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Query))
+	{
+		Query	   *query = (Query *) node;
+		ListCell   *lc;
+
+		/* Other location fields aren't written by nodeToString() */
+		query->queryId = UINT64CONST(0);
+		query->stmt_location = 0;
+		query->stmt_len = 0;
+		query->constraintDeps = NIL;
+		foreach(lc, query->rteperminfos)
+			((RTEPermissionInfo *) lfirst(lc))->relid = InvalidOid;
+
+		return query_tree_walker(query, shape_walker, context,
+								 QTW_EXAMINE_RTES_BEFORE);
+	}
+	else if (IsA(node, RangeTblEntry))
+	{
+		((RangeTblEntry *) node)->relid = InvalidOid;
+		return false;
+	}
+
+	return expression_tree_walker(node, shape_walker, context);
+}
+
+static uint64
+query_shape(CachedPlanSource *plansource)
+{
+	Query  *query;
+	char   *str;
+	uint64	shape;
+
+	if (plansource->query_list == NIL)
+		return UINT64CONST(0);
+
+	query = copyObject(linitial_node(Query, plansource->query_list));
+	(void) shape_walker((Node *) query, NULL);
+	str = nodeToString(query);
+	shape = hash_bytes_extended((const unsigned char *) str, strlen(str), 0);
+	pfree(str);
+
+	/* Zero means 'no shape' */
+	return (shape != UINT64CONST(0)) ? shape : UINT64CONST(1);
+}
+
+static void
+shape_entry_init(PGMShapeEntry *sentry)
+{
+	memset(sentry->calls, 0, sizeof(sentry->calls));
+	memset(sentry->latency, 0, sizeof(sentry->latency));
+	sentry->exec_time = 0.;
+	sentry->nblocks = 0.;
+}
+
+/*
+ * Plan cache mode learned on the shape: the plan kind with lower average
+ * latency, if both kinds have enough executions. -1 - not decided yet.
+ */
+static int
+shape_mode(PGMShapeEntry *sentry)
+{
+	double	custom;
+	double	generic;
+
+	if (sentry->calls[PGM_PLAN_CUSTOM] < pgm_min_samples ||
+		sentry->calls[PGM_PLAN_GENERIC] < pgm_min_samples)
+		return -1;
+
+	custom = sentry->latency[PGM_PLAN_CUSTOM] / sentry->calls[PGM_PLAN_CUSTOM];
+	generic = sentry->latency[PGM_PLAN_GENERIC] /
+											sentry->calls[PGM_PLAN_GENERIC];
+	return (generic <= custom) ? 1 : 2;
+}
+
+/*
+ * Switch the entry to the mode of its shape. Reference values are taken from
+ * the pooled statistics: the entry may have never been executed.
+ */
+static void
+entry_inherit_shape(MentorTblEntry *entry, PGMShapeEntry *sentry, int mode)
+{
+	int64	calls = sentry->calls[PGM_PLAN_CUSTOM] +
+					sentry->calls[PGM_PLAN_GENERIC];
+
+	entry_switch_mode(entry, mode);
+	entry->ref_exec_time = sentry->exec_time / calls;
+	entry->ref_nblocks = sentry->nblocks / calls;
+}
+
+/*
+ * Compute the shape of a new entry and inherit the mode learned on it. Called
+ * under the lock of the entry.
+ */
+static void
+shape_register(MentorTblEntry *entry, CachedPlanSource *plansource)
+{
+	PGMShapeEntry  *sentry;
+	int				mode;
+
+	entry->shape = query_shape(plansource);
+	if (entry->shape == UINT64CONST(0))
+		return;
+
+	sentry = (PGMShapeEntry *) dshash_find(pgm_shapes, &entry->shape, false);
+	if (sentry == NULL)
+		return;
+
+	mode = shape_mode(sentry);
+	if (mode >= 0 && entry->plan_cache_mode == 0)
+	{
+		entry_inherit_shape(entry, sentry, mode);
+		pgm_count(PGM_DECISION_SHAPE);
+	}
+	dshash_release_lock(pgm_shapes, sentry);
+}
+
+/*
+ * The entry doesn't have enough samples of its own to apply the strategy:
+ * follow the decision learned on its shape.
+ */
+static int
+reconsider_shape(MentorTblEntry *entry)
+{
+	PGMShapeEntry  *sentry;
+	int				mode;
+
+	if (!pgm_shape_pooling || entry->shape == UINT64CONST(0) || entry->fixed)
+		return -1;
+
+	sentry = (PGMShapeEntry *) dshash_find(pgm_shapes, &entry->shape, false);
+	if (sentry == NULL)
+		return -1;
+
+	mode = shape_mode(sentry);
+	if (mode >= 0 && mode != entry->plan_cache_mode)
+		entry_inherit_shape(entry, sentry, mode);
+	else
+		mode = -1;
+	dshash_release_lock(pgm_shapes, sentry);
+
+	if (mode < 0)
+		return -1;
+
+	move_mentor_status();
+	return PGM_DECISION_SHAPE;
+}
+
+/* Samples of this backend not folded into the shared models yet */
+static PGMCalibration calib_pending[PGM_PLAN_KINDS];
+
+/*
+ * Fold the pending samples of the plan kind into the shared model. The batch
+ * is decayed as a sequence of samples, so the shared sums are decayed by the
+ * number of samples in it.
+ */
+static void
+calibration_flush(PGMPlanKind plan_kind)
+{
+	PGMCalibration *p = &calib_pending[plan_kind];
+	PGMCalibration *c = &state->calib[plan_kind];
+	double			decay;
+
+	if (p->nsamples == 0)
+		return;
+
+	decay = pow(PGM_CALIBRATION_DECAY, (double) p->nsamples);
+	SpinLockAcquire(&state->calib_lock);
+	c->nsamples += p->nsamples;
+	c->weight = c->weight * decay + p->weight;
+	c->sum_x = c->sum_x * decay + p->sum_x;
+	c->sum_y = c->sum_y * decay + p->sum_y;
+	c->sum_xx = c->sum_xx * decay + p->sum_xx;
+	c->sum_xy = c->sum_xy * decay + p->sum_xy;
+	c->sum_yy = c->sum_yy * decay + p->sum_yy;
+	SpinLockRelease(&state->calib_lock);
+
+	memset(p, 0, sizeof(PGMCalibration));
+}
+
+/*
+ * Add a sample to the cost-to-time model of the plan kind. Samples are
+ * accumulated locally to not serialize all the executions on the lock.
+ */
+static void
+calibration_add(PGMPlanKind plan_kind, double cost, double exec_time)
+{
+	PGMCalibration *p = &calib_pending[plan_kind];
+
+	p->nsamples++;
+	p->weight = p->weight * PGM_CALIBRATION_DECAY + 1.;
+	p->sum_x = p->sum_x * PGM_CALIBRATION_DECAY + cost;
+	p->sum_y = p->sum_y * PGM_CALIBRATION_DECAY + exec_time;
+	p->sum_xx = p->sum_xx * PGM_CALIBRATION_DECAY + cost * cost;
+	p->sum_xy = p->sum_xy * PGM_CALIBRATION_DECAY + cost * exec_time;
+	p->sum_yy = p->sum_yy * PGM_CALIBRATION_DECAY + exec_time * exec_time;
+
+	if (p->nsamples >= PGM_CALIBRATION_BATCH)
+		calibration_flush(plan_kind);
+}
+
+/*
+ * Fit execution time = intercept + slope * cost. Returns false if there are
+ * not enough samples or the costs don't vary.
+ */
+static bool
+calibration_fit(PGMPlanKind plan_kind, PGMCalibration *c, double *slope,
+				double *intercept, double *r2)
+{
+	double	sxx;
+	double	sxy;
+	double	syy;
+
+	SpinLockAcquire(&state->calib_lock);
+	*c = state->calib[plan_kind];
+	SpinLockRelease(&state->calib_lock);
+
+	if (c->weight < PGM_CALIBRATION_MIN_WEIGHT)
+		return false;
+
+	sxx = c->sum_xx - c->sum_x * c->sum_x / c->weight;
+	sxy = c->sum_xy - c->sum_x * c->sum_y / c->weight;
+	syy = c->sum_yy - c->sum_y * c->sum_y / c->weight;
+	if (sxx <= 0.)
+		return false;
+
+	*slope = sxy / sxx;
+	*intercept = (c->sum_y - *slope * c->sum_x) / c->weight;
+	*r2 = (syy > 0.) ? sxy * sxy / (sxx * syy) : 1.;
+	return true;
+}
+
+/*
+ * Predict execution time of a plan of the kind with the given cost, ms.
+ * Returns -1 if the model isn't calibrated yet.
+ */
+static double
+calibration_predict(PGMPlanKind plan_kind, double cost)
+{
+	PGMCalibration	c;
+	double			slope;
+	double			intercept;
+	double			r2;
+
+	if (!calibration_fit(plan_kind, &c, &slope, &intercept, &r2) ||
+		slope <= 0.)
+		return -1.;
+
+	return Max(intercept + slope * cost, 0.);
+}
+
+/*
+ * The first switch of a statement in auto mode based on the shadow planning.
+ * If cost-to-time models of both plan kinds are calibrated, compare predicted
+ * latencies, custom plans paying the planning on each execution: the kind
+ * faster by more than pg_mentor.slo_margin wins. Otherwise force generic plan
+ * if it is estimated to cost not more than the custom one within
+ * pg_mentor.slo_margin. The reference values are taken from the statistics,
+ * if any.
+ */
+static int
+reconsider_shadow(MentorTblEntry *entry)
+{
+	double	generic = entry->shadow_cost[PGM_PLAN_GENERIC];
+	double	custom = entry->shadow_cost[PGM_PLAN_CUSTOM];
+	double	generic_ms;
+	double	custom_ms;
+	int		mode;
+
+	if (entry->plan_cache_mode != 0 || entry->fixed || entry->shadow_at == 0 ||
+		generic < 0. || custom < 0.)
+		return -1;
+
+	generic_ms = calibration_predict(PGM_PLAN_GENERIC, generic);
+	custom_ms = calibration_predict(PGM_PLAN_CUSTOM, custom);
+	if (generic_ms >= 0. && custom_ms >= 0.)
+	{
+		custom_ms += entry->shadow_plan_time[PGM_PLAN_CUSTOM];
+		if (generic_ms * (1. + pgm_slo_margin) < custom_ms)
+			mode = 1;
+		else if (custom_ms * (1. + pgm_slo_margin) < generic_ms)
+			mode = 2;
+		else
+			return -1;
+	}
+	else if (generic <= custom * (1. + pgm_slo_margin))
+		mode = 1;
+	else
+		return -1;
+
+	entry_switch_mode(entry, mode);
+	if (!ENTRY_NEVER_EXECUTED(entry))
+	{
+		entry->ref_exec_time = entry->avg_exec_time;
+		entry->ref_nblocks = entry->avg_nblocks;
+	}
+	move_mentor_status();
+	return PGM_DECISION_SHADOW;
+}
+
+/*
+ * Cost-to-time models of both plan kinds.
+ */
+Datum
+pg_mentor_calibration(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	int				kind;
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	/* Show the executions of this backend too */
+	for (kind = 0; kind < PGM_PLAN_KINDS; kind++)
+		calibration_flush(kind);
+
+	for (kind = 0; kind < PGM_PLAN_KINDS; kind++)
+	{
+		Datum			values[5] = {0};
+		bool			nulls[5] = {0};
+		PGMCalibration	c;
+		double			slope;
+		double			intercept;
+		double			r2;
+
+		values[0] = CStringGetTextDatum(plan_kind_names[kind]);
+		if (calibration_fit(kind, &c, &slope, &intercept, &r2))
+		{
+			values[2] = Float8GetDatum(slope);
+			values[3] = Float8GetDatum(intercept);
+			values[4] = Float8GetDatum(r2);
+		}
+		else
+			nulls[2] = nulls[3] = nulls[4] = true;
+		values[1] = Int64GetDatum(c.nsamples);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+typedef struct ShapeMember
+{
+	uint64	shape;
+	uint64	queryid;
+} ShapeMember;
+
+static int
+shape_member_cmp(const void *a, const void *b)
+{
+	const ShapeMember *ma = (const ShapeMember *) a;
+	const ShapeMember *mb = (const ShapeMember *) b;
+
+	if (ma->shape != mb->shape)
+		return pg_cmp_u64(ma->shape, mb->shape);
+	return pg_cmp_u64(ma->queryid, mb->queryid);
+}
+
+/*
+ * Shapes of the tracked statements with their members and pooled statistics.
+ */
+Datum
+pg_mentor_show_shapes(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+	ShapeMember		   *members;
+	int					nmembers = 0;
+	int					maxmembers = 64;
+	int					i;
+	int					j;
+	int					k;
+
+	pgm_init_shmem();
+	InitMaterializedSRF(fcinfo, 0);
+
+	members = (ShapeMember *) palloc(sizeof(ShapeMember) * maxmembers);
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		if (entry->shape == UINT64CONST(0))
+			continue;
+
+		if (nmembers >= maxmembers)
+		{
+			maxmembers *= 2;
+			members = (ShapeMember *) repalloc(members,
+											   sizeof(ShapeMember) * maxmembers);
+		}
+		members[nmembers].shape = entry->shape;
+		members[nmembers].queryid = entry->queryid;
+		nmembers++;
+	}
+	dshash_seq_term(&hash_seq);
+
+	qsort(members, nmembers, sizeof(ShapeMember), shape_member_cmp);
+
+	for (i = 0; i < nmembers; i = j)
+	{
+		Datum			values[7] = {0};
+		bool			nulls[7] = {0};
+		Datum		   *queryids;
+		PGMShapeEntry  *sentry;
+		int				kind;
+
+		for (j = i; j < nmembers && members[j].shape == members[i].shape; j++)
+			;
+
+		queryids = (Datum *) palloc(sizeof(Datum) * (j - i));
+		for (k = i; k < j; k++)
+			queryids[k - i] = Int64GetDatum((int64) members[k].queryid);
+
+		values[0] = Int64GetDatum((int64) members[i].shape);
+		values[1] = PointerGetDatum(construct_array_builtin(queryids, j - i,
+															INT8OID));
+		nulls[2] = true;
+		for (kind = 0; kind < PGM_PLAN_KINDS; kind++)
+			nulls[3 + kind * 2] = nulls[4 + kind * 2] = true;
+
+		sentry = (PGMShapeEntry *) dshash_find(pgm_shapes, &members[i].shape,
+											   false);
+		if (sentry != NULL)
+		{
+			int		mode = shape_mode(sentry);
+
+			if (mode >= 0)
+			{
+				values[2] = Int32GetDatum(mode);
+				nulls[2] = false;
+			}
+			for (kind = 0; kind < PGM_PLAN_KINDS; kind++)
+			{
+				values[3 + kind * 2] = Int64GetDatum(sentry->calls[kind]);
+				nulls[3 + kind * 2] = false;
+				if (sentry->calls[kind] > 0)
+				{
+					values[4 + kind * 2] =
+						Float8GetDatum(sentry->latency[kind] /
+									   sentry->calls[kind]);
+					nulls[4 + kind * 2] = false;
+				}
+			}
+			dshash_release_lock(pgm_shapes, sentry);
+		}
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+		pfree(queryids);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Apply the strategy to one entry. Returns the rule applied or -1.
+ */
+static int
+reconsider_entry(MentorTblEntry *entry, PGMTestResult *res)
+{
+	int		statnum = ring_buffer_size(entry);
+	int64  *nblocks;
+	double	stddev;
+	double	variation;
+
+	res->metric = NULL;
+	res->pvalue = -1.;
+
+	/* Do we need to skip this record? */
+	if (entry->plan_cache_mode < 0)
+		return -1;
+
+	/* Statements with a latency target follow their own rule */
+	if (entry->slo > 0.)
+		return (statnum > 0) ? reconsider_slo(entry, statnum, res) : -1;
+
+	/*
+	 * Not enough samples of its own: follow the shape or estimates of the
+	 * shadow planning.
+	 */
+	if (statnum < pgm_min_samples)
+	{
+		int		rule = reconsider_shape(entry);
+
+		return (rule >= 0) ? rule : reconsider_shadow(entry);
+	}
+
+	if (entry->avg_nblocks <= 0.)
+		return -1;
+
+	nblocks = palloc(sizeof(int64) * statnum);
+	samples_decode(ENTRY_NBLOCKS(entry), statnum, nblocks);
+	stddev = calculateStandardDeviation(statnum, nblocks);
+	if (pgm_normalize_by_rows)
+	{
+		int64 *rows = palloc(sizeof(int64) * statnum);
+
+		samples_decode(ENTRY_ROWS(entry), statnum, rows);
+		variation = per_row_variation(statnum, nblocks, rows);
+		pfree(rows);
+	}
+	else
+		variation = stddev / entry->avg_nblocks;
+	pfree(nblocks);
+
+	/* Step 1: auto-mode => generic */
+	if (entry->plan_cache_mode == 0 && !entry->fixed &&
+		entry->ref_exec_time < 0. &&
+		entry->avg_exec_time < entry->plan_time &&
+		variation <= 0.3 &&
+		confident(entry, statnum, false, entry->plan_time, false, res))
+	{
+		pg_mentor_set_plan_mode_int(entry, 1, -1, -1, false);
+		return PGM_DECISION_AUTO_TO_GENERIC;
+	}
+	/* Step 2: */
+	else if (entry->plan_cache_mode == 1 && !entry->fixed &&
+		entry->ref_exec_time > 0. &&
+		entry->avg_exec_time < entry->plan_time * 2.0 &&
+		entry->avg_nblocks/entry->ref_nblocks > 1.0 &&
+		confident_worse(entry, statnum, PGM_PLAN_GENERIC, entry->ref_nblocks,
+						res))
+	{
+		pg_mentor_set_plan_mode_int(entry, 2, -1, -1, false);
+		return PGM_DECISION_GENERIC_TO_CUSTOM;
+	}
+	/* Step 3: auto-mode => custom */
+	else if (entry->plan_cache_mode == 0 && !entry->fixed &&
+		entry->ref_exec_time <= 0. &&
+		entry->avg_exec_time > entry->plan_time * 1.0 &&
+		variation > 0.5 &&
+		confident(entry, statnum, false, entry->plan_time, true, res))
+	{
+		pg_mentor_set_plan_mode_int(entry, 2, -1, -1, false);
+		return PGM_DECISION_AUTO_TO_CUSTOM;
+	}
+	/* Step 4: 'custom' => 'generic' */
+	else if (entry->plan_cache_mode == 2 && !entry->fixed &&
+		entry->ref_exec_time > 0. &&
+		(entry->avg_exec_time < entry->plan_time * 2.0 ||
+		entry->ref_nblocks / entry->avg_nblocks < 2.0) &&
+		variation <= 0.3 &&
+		(confident(entry, statnum, false, entry->plan_time * 2.0, false, res) ||
+		 confident(entry, statnum, true, entry->ref_nblocks / 2.0, true, res)))
+	{
+		pg_mentor_set_plan_mode_int(entry, 1, -1, -1, false);
+		return PGM_DECISION_CUSTOM_TO_GENERIC;
+	}
+	/*
+	 * Step 5: generic plan spends in ExecutorStart (locking and
+	 * initialising partitions before run-time pruning) more than planning
+	 * of a custom plan would take. Only averages are collected for executor
+	 * phases, so just demand enough executions of generic plans.
+	 */
+	else if (entry->plan_cache_mode != 2 && !entry->fixed &&
+		entry->plan_time > 0. &&
+		generic_startup_overhead(entry) > entry->plan_time &&
+		(pgm_confidence_level <= 0. ||
+		 entry->phases[PGM_PLAN_GENERIC].nexecs >= pgm_min_samples))
+	{
+		res->metric = NULL;
+		res->pvalue = -1.;
+		pg_mentor_set_plan_mode_int(entry, 2, -1, -1, false);
+		return PGM_DECISION_STARTUP_TO_CUSTOM;
+	}
+
+	/* Skip the record */
+	return -1;
+}
+
+/*
+ * Pass through the table and apply the strategy. Each decision is reported
+ * into the tuplestore, if given.
+ */
+static void
+reconsider_run(ReturnSetInfo *rsinfo, int32 *to_generic, int32 *to_custom,
+			   int32 *nvalues)
+{
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+
+	pgm_count(PGM_COUNTER_RECONSIDER);
+
+	*to_generic = *to_custom = *nvalues = 0;
+
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		PGMTestResult	res;
+		int				old_mode = entry->plan_cache_mode;
+		int				rule;
+
+		(*nvalues)++;
+
+		LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+		rule = reconsider_entry(entry, &res);
+		LWLockRelease(&entry->lock);
+		if (rule < 0)
+			continue;
+
+		pgm_count(rule);
+		if (entry->plan_cache_mode == 1)
+			(*to_generic)++;
+		else
+			(*to_custom)++;
+
+		if (rsinfo != NULL)
+		{
+			Datum	values[10] = {0};
+			bool	nulls[10] = {0};
+
+			values[0] = Int64GetDatumFast((int64) entry->queryid);
+			values[1] = CStringGetTextDatum(decision_names[rule]);
+			values[2] = Int32GetDatum(old_mode);
+			values[3] = Int32GetDatum(entry->plan_cache_mode);
+			if (res.metric != NULL)
+			{
+				values[4] = CStringGetTextDatum(res.metric);
+				values[5] = Float8GetDatum(res.mean);
+				values[6] = Float8GetDatum(res.reference);
+				values[7] = Float8GetDatum(res.ci_low);
+				values[8] = Float8GetDatum(res.ci_high);
+				if (res.pvalue >= 0.)
+					values[9] = Float8GetDatum(res.pvalue);
+				else
+					nulls[9] = true;
+			}
+			else
+				nulls[4] = nulls[5] = nulls[6] = nulls[7] = nulls[8] =
+					nulls[9] = true;
+
+			tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+								 values, nulls);
+		}
+	}
+	dshash_seq_term(&hash_seq);
+}
+
+Datum
+reconsider_ps_modes(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HeapTuple			tuple;
+	int32				to_generic;
+	int32				to_custom;
+	int32				nvalues;
+	Datum				values[3] = {0};
+	bool				nulls[3] = {0};
+
+	pgm_init_shmem();
+
+	reconsider_run(NULL, &to_generic, &to_custom, &nvalues);
+
+	values[0] = Int32GetDatum(to_generic);
+	values[1] = Int32GetDatum(to_custom);
+	values[2] = Int32GetDatum(nvalues - to_generic - to_custom);
+
+	tuple = heap_form_tuple(rsinfo->expectedDesc, values, nulls);
+	return HeapTupleGetDatum(tuple);
+}
+
+/*
+ * The same as reconsider_ps_modes, but returns each decision made together
+ * with the test it is based on.
+ */
+Datum
+pg_mentor_reconsider(PG_FUNCTION_ARGS)
+{
+	int32	to_generic;
+	int32	to_custom;
+	int32	nvalues;
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+	reconsider_run((ReturnSetInfo *) fcinfo->resultinfo,
+				   &to_generic, &to_custom, &nvalues);
+
+	return (Datum) 0;
+}
+
+
+/*
+ * Candidate for the planning budget strategy.
+ */
+typedef struct BudgetCandidate
+{
+	uint64	queryid;
+	double	plan_rate; /* planning time per second of wall clock, ms */
+	double	penalty; /* relative slowdown of generic plan executions */
+} BudgetCandidate;
+
+static int
+budget_candidate_cmp(const void *a, const void *b)
+{
+	const BudgetCandidate *ca = (const BudgetCandidate *) a;
+	const BudgetCandidate *cb = (const BudgetCandidate *) b;
+
+	/* Largest consumers go first */
+	return (ca->plan_rate < cb->plan_rate) - (ca->plan_rate > cb->plan_rate);
+}
+
+/*
+ * Average time of an execution of the plan kind, including the executor
+ * startup, ms. -1 if never executed.
+ */
+static double
+avg_kind_exec_time(MentorTblEntry *entry, PGMPlanKind kind)
+{
+	PGMPhaseStats *phases = &entry->phases[kind];
+
+	if (phases->nexecs == 0)
+		return -1.;
+
+	return (phases->time[PGM_PHASE_START] + phases->time[PGM_PHASE_RUN] +
+			phases->time[PGM_PHASE_FINISH]) / phases->nexecs;
+}
+
+/*
+ * Planning CPU budget strategy.
+ *
+ * Rank statements by their planning time per second since the last
+ * statistics reset and force generic plans on the largest consumers until
+ * the projected planning time fits into the target. A statement is skipped
+ * if its generic plan executes slower than the custom one by more than the
+ * tolerance, or if it hasn't been executed with both plan kinds yet.
+ *
+ * The target is given in ms of planning per second or, with share = true, as
+ * a share of the time tracked statements spend in planning and execution.
+ */
+Datum
+pg_mentor_planning_budget(PG_FUNCTION_ARGS)
+{
+	double				target = PG_GETARG_FLOAT8(0);
+	double				tolerance = PG_GETARG_FLOAT8(1);
+	bool				share = PG_GETARG_BOOL(2);
+	bool				dry_run = PG_GETARG_BOOL(3);
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+	TimestampTz			now = GetCurrentTimestamp();
+	List			   *candidates = NIL;
+	BudgetCandidate	   *sorted;
+	double				measured = 0.;
+	double				exec_rate = 0.;
+	double				projected;
+	int					ncandidates;
+	int					i;
+
+	if (target < 0. || (share && target > 1.) || tolerance < 0.)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("invalid planning budget parameters")));
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		BudgetCandidate	   *c;
+		double				seconds;
+		double				generic;
+		double				custom;
+		double				plan_time;
+		bool				skip;
+
+		/* Read everything at once: a reset changes all of it */
+		LWLockAcquire(&entry->lock, LW_SHARED);
+		seconds = (double) (now - entry->stats_since) / USECS_PER_SEC;
+		if (seconds <= 0.)
+		{
+			LWLockRelease(&entry->lock);
+			continue;
+		}
+		plan_time = entry->total_plan_time;
+		exec_rate += entry->total_time / seconds;
+		generic = avg_kind_exec_time(entry, PGM_PLAN_GENERIC);
+		custom = avg_kind_exec_time(entry, PGM_PLAN_CUSTOM);
+		skip = (entry->plan_cache_mode == 1 || entry->fixed);
+		LWLockRelease(&entry->lock);
+
+		measured += plan_time / seconds;
+
+		if (skip || plan_time <= 0.)
+			continue;
+
+		if (generic < 0. || custom <= 0.)
+			continue;
+
+		c = palloc(sizeof(BudgetCandidate));
+		c->queryid = entry->queryid;
+		c->plan_rate = plan_time / seconds;
+		c->penalty = generic / custom - 1.;
+		candidates = lappend(candidates, c);
+	}
+	dshash_seq_term(&hash_seq);
+
+	if (share)
+		target *= measured + exec_rate;
+
+	ncandidates = list_length(candidates);
+	sorted = palloc(sizeof(BudgetCandidate) * Max(ncandidates, 1));
+	for (i = 0; i < ncandidates; i++)
+		sorted[i] = *(BudgetCandidate *) list_nth(candidates, i);
+	qsort(sorted, ncandidates, sizeof(BudgetCandidate), budget_candidate_cmp);
+
+	projected = measured;
+	for (i = 0; i < ncandidates && projected > target; i++)
+	{
+		BudgetCandidate	   *c = &sorted[i];
+		Datum				values[7] = {0};
+		bool				nulls[7] = {0};
+		bool				switched = false;
+
+		if (c->penalty <= tolerance)
+		{
+			if (dry_run)
+				switched = true;
+			else
+			{
+				entry = (MentorTblEntry *) dshash_find(pgm_hash, &c->queryid,
+													   true);
+
+				/* Someone could decide on it in the meantime */
+				if (entry != NULL && entry->plan_cache_mode != 1 &&
+					!entry->fixed)
+				{
+					LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+					pg_mentor_set_plan_mode_int(entry, 1, -1, -1, false);
+					LWLockRelease(&entry->lock);
+					pgm_count(PGM_DECISION_PLANNING_BUDGET);
+					switched = true;
+				}
+				if (entry != NULL)
+					dshash_release_lock(pgm_hash, entry);
+			}
+
+			/* Generic plan is built once: its planning cost is negligible */
+			if (switched)
+				projected -= c->plan_rate;
+		}
+
+		values[0] = Int64GetDatumFast((int64) c->queryid);
+		values[1] = Float8GetDatum(c->plan_rate);
+		values[2] = Float8GetDatum(c->penalty);
+		values[3] = BoolGetDatum(switched);
+		values[4] = Float8GetDatum(measured);
+		values[5] = Float8GetDatum(Max(projected, 0.));
+		values[6] = Float8GetDatum(target);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+							 values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Time-of-day schedules.
+ *
+ * Workloads often differ between the day and the night (OLTP vs batch
+ * loads), and so does the best plan mode of a statement. With the history
+ * enabled each entry keeps per-hour aggregates of latency per plan kind.
+ * pg_mentor_learn_schedule() chooses the best kind for each hour of the day
+ * and the schedule is applied to the whole table at the start of each hour,
+ * before regressions happen. It is done by the scheduler worker of the
+ * database if pg_mentor.scheduler is on, by the first backend noticing the
+ * new hour otherwise.
+ */
+
+/*
+ * Switch statements to the modes scheduled for the current hour. Only one
+ * backend does the pass at a time; the hour is claimed once the pass is
+ * done, so an error in the middle leaves it to the next statement.
+ */
+static void
+apply_schedule(void)
+{
+	uint64				hour;
+	uint64				prev;
+
+	hour = GetCurrentStatementStartTimestamp() / USECS_PER_HOUR;
+	prev = pg_atomic_read_u64(&state->schedule_hour);
+	if (prev == hour || !pg_atomic_test_set_flag(&state->schedule_busy))
+		return;
+
+	PG_TRY();
+	{
+		dshash_seq_status	hash_seq;
+		MentorTblEntry	   *entry;
+		int					h = hour % HOURS_PER_DAY;
+
+		/* The previous holder of the flag could apply it already */
+		prev = pg_atomic_read_u64(&state->schedule_hour);
+		if (prev != hour)
+		{
+			dshash_seq_init(&hash_seq, pgm_hash, true);
+			while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+			{
+				int mode = entry->schedule[h];
+
+				if (mode < 0 || entry->fixed || entry->plan_cache_mode == mode ||
+					ENTRY_NEVER_EXECUTED(entry))
+					continue;
+
+				LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+				pg_mentor_set_plan_mode_int(entry, mode, -1, -1, false);
+				LWLockRelease(&entry->lock);
+				pgm_count(PGM_DECISION_SCHEDULE);
+			}
+			dshash_seq_term(&hash_seq);
+
+			/*
+			 * Don't overwrite the request of pg_mentor_learn_schedule() to
+			 * apply a new schedule, made during the pass.
+			 */
+			(void) pg_atomic_compare_exchange_u64(&state->schedule_hour,
+												  &prev, hour);
+		}
+	}
+	PG_FINALLY();
+	{
+		pg_atomic_clear_flag(&state->schedule_busy);
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Show the history of statements, one row per hour and plan kind.
+ */
+Datum
+pg_mentor_show_history(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	if (pgm_history_buckets == 0)
+		return (Datum) 0;
+
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		int i;
+		int kind;
+
+		LWLockAcquire(&entry->lock, LW_SHARED);
+		for (i = 0; i < pgm_history_buckets; i++)
+		{
+			PGMHistoryBucket *bucket = &ENTRY_HISTORY(entry)[i];
+
+			if (bucket->hour == 0)
+				continue;
+
+			for (kind = 0; kind < PGM_PLAN_KINDS; kind++)
+			{
+				Datum	values[5] = {0};
+				bool	nulls[5] = {0};
+
+				if (bucket->nexecs[kind] == 0)
+					continue;
+
+				values[0] = Int64GetDatumFast((int64) entry->queryid);
+				values[1] = TimestampTzGetDatum(bucket->hour * USECS_PER_HOUR);
+				values[2] = CStringGetTextDatum(plan_kind_names[kind]);
+				values[3] = Int64GetDatum(bucket->nexecs[kind]);
+				values[4] = Float8GetDatum(bucket->latency[kind] /
+										   bucket->nexecs[kind]);
+				tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+									 values, nulls);
+			}
+		}
+		LWLockRelease(&entry->lock);
+	}
+	dshash_seq_term(&hash_seq);
+
+	return (Datum) 0;
+}
+
+/*
+ * Learn plan mode schedule of each statement from its history.
+ *
+ * For each hour of the day average latencies of plan kinds are compared over
+ * all the buckets of this hour. A mode is scheduled if both kinds have at
+ * least min_calls executions and one of them is faster by more than margin.
+ * Returns the schedule learned.
+ */
+Datum
+pg_mentor_learn_schedule(PG_FUNCTION_ARGS)
+{
+	int32				min_calls = PG_GETARG_INT32(0);
+	double				margin = PG_GETARG_FLOAT8(1);
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+
+	if (pgm_history_buckets == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("statistics history is disabled"),
+				 errhint("Set pg_mentor.history_buckets and restart the server.")));
+
+	pgm_init_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	dshash_seq_init(&hash_seq, pgm_hash, true);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		int64	nexecs[HOURS_PER_DAY][PGM_PLAN_KINDS] = {0};
+		double	latency[HOURS_PER_DAY][PGM_PLAN_KINDS] = {0};
+		int		i;
+		int		h;
+
+		LWLockAcquire(&entry->lock, LW_SHARED);
+		for (i = 0; i < pgm_history_buckets; i++)
+		{
+			PGMHistoryBucket   *bucket = &ENTRY_HISTORY(entry)[i];
+			int					kind;
+
+			if (bucket->hour == 0)
+				continue;
+
+			h = bucket->hour % HOURS_PER_DAY;
+			for (kind = 0; kind < PGM_PLAN_KINDS; kind++)
+			{
+				nexecs[h][kind] += bucket->nexecs[kind];
+				latency[h][kind] += bucket->latency[kind];
+			}
+		}
+		LWLockRelease(&entry->lock);
+
+		for (h = 0; h < HOURS_PER_DAY; h++)
+		{
+			Datum	values[5] = {0};
+			bool	nulls[5] = {0};
+			double	custom;
+			double	generic;
+			int		mode = -1;
+
+			entry->schedule[h] = -1;
 
-			if (query->queryId != entry->queryid)
+			if (nexecs[h][PGM_PLAN_CUSTOM] < Max(min_calls, 1) ||
+				nexecs[h][PGM_PLAN_GENERIC] < Max(min_calls, 1))
+				continue;
+
+			custom = latency[h][PGM_PLAN_CUSTOM] / nexecs[h][PGM_PLAN_CUSTOM];
+			generic = latency[h][PGM_PLAN_GENERIC] / nexecs[h][PGM_PLAN_GENERIC];
+
+			if (generic * (1. + margin) < custom)
+				mode = 1;
+			else if (custom * (1. + margin) < generic)
+				mode = 2;
+			else
 				continue;
 
-			set_plan_cache_mode(ps, entry->plan_cache_mode);
+			entry->schedule[h] = mode;
+
+			values[0] = Int64GetDatumFast((int64) entry->queryid);
+			values[1] = Int32GetDatum(h);
+			values[2] = Int32GetDatum(mode);
+			values[3] = Float8GetDatum(custom);
+			values[4] = Float8GetDatum(generic);
+			tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+								 values, nulls);
 		}
 	}
 	dshash_seq_term(&hash_seq);
 
-	if (local_state_generation < generation)
-		local_state_generation = generation;
+	/* Apply the new schedule at once */
+	pg_atomic_write_u64(&state->schedule_hour, 0);
+
+	return (Datum) 0;
 }
 
+/*
+ * Which entries and which parts of them should be reset.
+ */
+typedef struct ResetFilter
+{
+	int			status; /* plan cache mode, -1 - any */
+	TimestampTz	older_than; /* 0 - any */
+	List	   *relids; /* NIL - any */
+
+	bool		stats;
+	bool		decisions;
+} ResetFilter;
+
 static bool
-move_mentor_status()
+entry_depends_on(MentorTblEntry *entry, List *relids)
 {
-	pg_atomic_fetch_add_u64(&state->state_decisions, 1);
+	int i;
+
+	/*
+	 * Dependencies are unknown or too many to be remembered. Don't match: a
+	 * relid filter must not turn into a reset of every such statement.
+	 */
+	if (entry->nrelids < 0)
+		return false;
+
+	for (i = 0; i < entry->nrelids; i++)
+	{
+		if (list_member_oid(relids, entry->relids[i]))
+			return true;
+	}
+	return false;
+}
+
+static bool
+reset_filter_match(ResetFilter *filter, MentorTblEntry *entry)
+{
+	if (filter->status >= 0 && entry->plan_cache_mode != filter->status)
+		return false;
+	if (filter->older_than != 0 && entry->since >= filter->older_than)
+		return false;
+	if (filter->relids != NIL && !entry_depends_on(entry, filter->relids))
+		return false;
 	return true;
 }
 
+/*
+ * Reset the entry according to the filter.
+ * Returns true if any decision has been changed.
+ */
+static bool
+reset_entry(ResetFilter *filter, MentorTblEntry *entry)
+{
+	bool	changed = false;
+
+	LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+	if (filter->decisions)
+	{
+		changed = (entry->plan_cache_mode != 0 || entry->fixed);
+		entry->plan_cache_mode = 0;
+		entry->fixed = false;
+		entry->ref_exec_time = -1.0;
+		entry->ref_nblocks = -1.;
+		memset(entry->schedule, -1, sizeof(entry->schedule));
+	}
+	if (filter->stats)
+		entry_reset_stats(entry);
+	LWLockRelease(&entry->lock);
+	if (filter->stats && filter->decisions)
+		entry->since = 0;
+
+	return changed;
+}
+
+typedef struct ResetKey
+{
+	uint32	hash;
+	uint64	queryid;
+} ResetKey;
+
+static int
+reset_key_cmp(const void *a, const void *b)
+{
+	const ResetKey *ka = (const ResetKey *) a;
+	const ResetKey *kb = (const ResetKey *) b;
+	int				cmp = pg_cmp_u32(ka->hash, kb->hash);
+
+	return cmp != 0 ? cmp : pg_cmp_u64(ka->queryid, kb->queryid);
+}
+
+/*
+ * Clean decisions has been made and/or collected statistics.
+ *
+ * Without arguments cleans everything. Filters allow to reset only statements
+ * with specific queryIds, plan cache mode, added before some moment or
+ * depending on a relation (or its partitioned ancestors). Only partitions of
+ * the table that contain affected entries are locked exclusively.
+ */
 Datum
-pg_mentor_reload_conf(PG_FUNCTION_ARGS)
+pg_mentor_reset(PG_FUNCTION_ARGS)
 {
+	ResetFilter			filter;
+	MentorTblEntry	   *entry;
+	ResetKey		   *keys;
+	int					nkeys = 0;
+	int32				counter = 0;
+	bool				changed = false;
+	int					i;
+
+	filter.status = PG_ARGISNULL(1) ? -1 : PG_GETARG_INT32(1);
+	filter.older_than = 0;
+	if (!PG_ARGISNULL(2))
+		filter.older_than = DatumGetTimestampTz(
+			DirectFunctionCall2(timestamptz_mi_interval,
+								TimestampTzGetDatum(GetCurrentTimestamp()),
+								PG_GETARG_DATUM(2)));
+	filter.relids = NIL;
+	if (!PG_ARGISNULL(3))
+	{
+		Oid		relid = PG_GETARG_OID(3);
+
+		filter.relids = list_make1_oid(relid);
+		if (get_rel_relispartition(relid))
+			filter.relids = list_concat(filter.relids,
+										get_partition_ancestors(relid));
+	}
+	filter.stats = PG_ARGISNULL(4) ? true : PG_GETARG_BOOL(4);
+	filter.decisions = PG_ARGISNULL(5) ? true : PG_GETARG_BOOL(5);
+
+	if (!filter.stats && !filter.decisions)
+		PG_RETURN_INT32(0);
+
 	pgm_init_shmem();
 
-	move_mentor_status();
-	PG_RETURN_BOOL(true);
+	/* Collect keys of candidates, holding partition locks in shared mode */
+	if (!PG_ARGISNULL(0))
+	{
+		ArrayType  *queryids = PG_GETARG_ARRAYTYPE_P(0);
+		Datum	   *elems;
+		bool	   *elnulls;
+		int			nelems;
+
+		deconstruct_array_builtin(queryids, INT8OID, &elems, &elnulls, &nelems);
+		keys = (ResetKey *) palloc(sizeof(ResetKey) * Max(nelems, 1));
+		for (i = 0; i < nelems; i++)
+		{
+			if (!elnulls[i])
+				keys[nkeys++].queryid = (uint64) DatumGetInt64(elems[i]);
+		}
+	}
+	else
+	{
+		dshash_seq_status	hash_seq;
+		int					maxkeys = 64;
+
+		keys = (ResetKey *) palloc(sizeof(ResetKey) * maxkeys);
+		dshash_seq_init(&hash_seq, pgm_hash, false);
+		while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+		{
+			if (!reset_filter_match(&filter, entry))
+				continue;
+
+			if (nkeys >= maxkeys)
+			{
+				maxkeys *= 2;
+				keys = (ResetKey *) repalloc(keys, sizeof(ResetKey) * maxkeys);
+			}
+			keys[nkeys++].queryid = entry->queryid;
+		}
+		dshash_seq_term(&hash_seq);
+	}
+
+	/*
+	 * Reset each statement once, however many times it is listed, and pass
+	 * through each partition once: dshash chooses it by the high bits of the
+	 * key hash.
+	 */
+	for (i = 0; i < nkeys; i++)
+		keys[i].hash = dshash_memhash(&keys[i].queryid, sizeof(uint64), NULL);
+	qsort(keys, nkeys, sizeof(ResetKey), reset_key_cmp);
+	nkeys = qunique(keys, nkeys, sizeof(ResetKey), reset_key_cmp);
+
+	/*
+	 * Now reset the entries. Recheck the filter: something might have changed
+	 * since the scan.
+	 */
+	for (i = 0; i < nkeys; i++)
+	{
+		entry = (MentorTblEntry *) dshash_find(pgm_hash, &keys[i].queryid, true);
+		if (entry == NULL)
+			continue;
+
+		if (reset_filter_match(&filter, entry))
+		{
+			changed |= reset_entry(&filter, entry);
+			counter++;
+		}
+		dshash_release_lock(pgm_hash, entry);
+	}
+
+	/*
+	 * Let backends re-read plan cache modes, but only once. Pins are
+	 * re-applied from the pinned_modes table.
+	 */
+	if (changed)
+	{
+		pg_atomic_fetch_add_u64(&state->pins_generation, 1);
+		move_mentor_status();
+	}
+
+	pgm_count(PGM_COUNTER_RESET);
+	PG_RETURN_INT32(counter);
 }
 
-static bool
-pg_mentor_set_plan_mode_int(MentorTblEntry *entry, int status,
-							double ref_exec_time, double ref_nblocks, bool fixed)
+/*
+ * Micro-benchmark: per-call overhead of each timing source available on this
+ * machine. Helps to decide whether pg_mentor.timing_source = 'tsc' is worth it.
+ */
+Datum
+pg_mentor_timing_overhead(PG_FUNCTION_ARGS)
 {
-	entry->plan_cache_mode = status;
-	entry->fixed = fixed;
+	int32			loops = PG_GETARG_INT32(0);
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	int				source;
 
-	if (entry->nblocks[0] < 0 && (ref_nblocks < 0. || ref_exec_time < 0.))
-		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				errmsg("reference data cannot be null for never executed query")));
+	if (loops <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of loops must be positive")));
 
-	entry->ref_nblocks = (ref_nblocks > 0.) ?
-											ref_nblocks : entry->avg_nblocks;
-	entry->ref_exec_time = (ref_exec_time > 0.) ?
-											ref_exec_time : entry->avg_exec_time;
+	InitMaterializedSRF(fcinfo, 0);
 
-	/* Tell other backends that they may update their statuses. */
-	move_mentor_status();
-	return true;
+	for (source = PGM_TIMING_CLOCK; source <= PGM_TIMING_TSC; source++)
+	{
+		Datum		values[4] = {0};
+		bool		nulls[4] = {0};
+		instr_time	start;
+		instr_time	duration;
+		int32		i;
+
+		if (source == PGM_TIMING_CLOCK)
+		{
+			INSTR_TIME_SET_CURRENT(start);
+			for (i = 0; i < loops; i++)
+				INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SET_CURRENT(duration);
+		}
+		else
+		{
+#ifdef PGM_HAVE_TSC
+			if (!tsc_is_invariant())
+				continue;
+
+			INSTR_TIME_SET_CURRENT(start);
+			for (i = 0; i < loops; i++)
+				(void) __rdtsc();
+			INSTR_TIME_SET_CURRENT(duration);
+#else
+			continue;
+#endif
+		}
+		INSTR_TIME_SUBTRACT(duration, start);
+
+		values[0] = CStringGetTextDatum(timing_source_options[source].name);
+		values[1] = BoolGetDatum((source == PGM_TIMING_TSC) == pgm_use_tsc);
+		values[2] = Int32GetDatum(loops);
+		values[3] = Float8GetDatum((double) INSTR_TIME_GET_NANOSEC(duration) /
+								   loops);
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
 }
 
-Datum
-pg_mentor_set_plan_mode(PG_FUNCTION_ARGS)
+/*
+ * Shadow planning.
+ *
+ * Backends keep the source text of new statements and a sample of parameter
+ * values of one of their executions. A background worker, launched by
+ * pg_mentor_shadow_plan() for the current database, re-analyses each
+ * statement not planned yet and plans it both generically and with the sample
+ * values, never executing. Planning time and estimated cost of both plans
+ * let the strategy make the first switch of a statement with no production
+ * risk.
+ */
+static void
+shadow_register(MentorTblEntry *entry, CachedPlanSource *plansource)
 {
-	int64			queryId = PG_GETARG_INT64(0);
-	int				status = PG_GETARG_INT32(1);
-	double			ref_exec_time = PG_ARGISNULL(2) ? -1. : PG_GETARG_FLOAT8(2);
-	double			ref_nblocks = PG_ARGISNULL(3) ? -1. : PG_GETARG_FLOAT8(3);
-	bool			fixed = PG_GETARG_BOOL(4);
-	bool			found;
+	PGMShadowSource	   *src;
+	const char		   *query_string = plansource->query_string;
+	const char		   *search_path = namespace_search_path;
+	RawStmt			   *rawstmt = plansource->raw_parse_tree;
+	int					query_len;
+	int					search_path_len;
+	Size				size;
+
+	if (query_string == NULL)
+		return;
+
+	/*
+	 * A PREPARE sent by the simple protocol shares the source text with the
+	 * other statements of the query string: keep the statement's own text.
+	 * Zero length means the rest of the string.
+	 */
+	query_len = strlen(query_string);
+	if (rawstmt != NULL && rawstmt->stmt_location >= 0)
+	{
+		Assert(rawstmt->stmt_location <= query_len);
+		query_string += rawstmt->stmt_location;
+		if (rawstmt->stmt_len > 0)
+			query_len = rawstmt->stmt_len;
+		else
+			query_len -= rawstmt->stmt_location;
+	}
+	search_path_len = strlen(search_path);
+	if (query_len > PGM_SHADOW_MAX_QUERY_LEN)
+		return;
+
+	size = offsetof(PGMShadowSource, paramtypes) +
+		sizeof(Oid) * plansource->num_params + query_len + search_path_len + 2;
+	entry->shadow_source = dsa_allocate_extended(dsa, size,
+												 DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(entry->shadow_source))
+		return;
+
+	src = (PGMShadowSource *) dsa_get_address(dsa, entry->shadow_source);
+	src->nparams = plansource->num_params;
+	src->query_len = query_len;
+	src->search_path_len = search_path_len;
+	if (plansource->num_params > 0)
+		memcpy(src->paramtypes, plansource->param_types,
+			   sizeof(Oid) * plansource->num_params);
+	memcpy(SHADOW_SOURCE_QUERY(src), query_string, query_len);
+	SHADOW_SOURCE_QUERY(src)[query_len] = '\0';
+	memcpy(SHADOW_SOURCE_SEARCH_PATH(src), search_path, search_path_len + 1);
+	entry->shadow_nparams = plansource->num_params;
+}
+
+/*
+ * Keep parameter values of the execution as the sample for the shadow
+ * planning. Called without the lock of the entry.
+ */
+static void
+shadow_capture_params(uint64 queryId, ParamListInfo params)
+{
+	char		   *buf = palloc(PGM_OUTLIER_PARAMS_SIZE);
+	int				nparams;
+	Size			len;
+	dsa_pointer		chunk;
 	MentorTblEntry *entry;
-	bool			result = false;
 
+	/* Values which don't fit would be useless for planning */
+	if (!params_serialize(params, buf, PGM_OUTLIER_PARAMS_SIZE, &nparams,
+						  &len) || nparams == 0)
+	{
+		pfree(buf);
+		return;
+	}
+
+	chunk = dsa_allocate_extended(dsa, len, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(chunk))
+	{
+		pfree(buf);
+		return;
+	}
+	memcpy(dsa_get_address(dsa, chunk), buf, len);
+	pfree(buf);
+
+	entry = (MentorTblEntry *) dshash_find(pgm_hash, &queryId, true);
+	if (entry != NULL && !DsaPointerIsValid(entry->shadow_params))
+	{
+		entry->shadow_params = chunk;
+		entry->shadow_params_len = len;
+		chunk = InvalidDsaPointer;
+	}
+	if (entry != NULL)
+		dshash_release_lock(pgm_hash, entry);
+
+	/* Another backend has been faster */
+	if (DsaPointerIsValid(chunk))
+		dsa_free(dsa, chunk);
+}
+
+static ParamListInfo
+params_restore(char *buf, int nparams)
+{
+	ParamListInfo	params = makeParamList(nparams);
+	char		   *ptr = buf;
+	int				i;
+
+	for (i = 0; i < nparams; i++)
+	{
+		ParamExternData *prm = &params->params[i];
+
+		memcpy(&prm->ptype, ptr, sizeof(Oid));
+		ptr += sizeof(Oid);
+		prm->value = datumRestore(&ptr, &prm->isnull);
+		prm->pflags = PARAM_FLAG_CONST;
+	}
+	return params;
+}
+
+/*
+ * Plan the analysed statement, returns the total estimated cost.
+ */
+static double
+shadow_plan_queries(List *querytrees, const char *query_string,
+					ParamListInfo params, double *plan_time)
+{
+	List	   *stmts;
+	ListCell   *lc;
+	uint64		start;
+	double		cost = 0.;
+
+	start = pgm_time_now();
+	stmts = pg_plan_queries(copyObject(querytrees), query_string,
+							CURSOR_OPT_PARALLEL_OK, params);
+	*plan_time = pgm_time_diff_ms(start, pgm_time_now());
+
+	foreach(lc, stmts)
+	{
+		PlannedStmt *stmt = lfirst_node(PlannedStmt, lc);
+
+		if (stmt->commandType != CMD_UTILITY)
+			cost += stmt->planTree->total_cost;
+	}
+	return cost;
+}
+
+/*
+ * Analyse the statement as it has been prepared and plan it both ways.
+ */
+static void
+shadow_plan_statement(PGMShadowSource *src, char *params_buf, int nparams,
+					  double *plan_time, double *cost)
+{
+	const char *query_string = SHADOW_SOURCE_QUERY(src);
+	List	   *parsetrees;
+	RawStmt	   *rawstmt;
+	List	   *querytrees;
+	ParamListInfo params = NULL;
+
+	(void) set_config_option("search_path", SHADOW_SOURCE_SEARCH_PATH(src),
+							 PGC_USERSET, PGC_S_SESSION, GUC_ACTION_SET,
+							 true, 0, false);
+
+	parsetrees = pg_parse_query(query_string);
+	if (list_length(parsetrees) != 1)
+		elog(ERROR, "unexpected number of statements in the source text");
+	rawstmt = linitial_node(RawStmt, parsetrees);
+
+	/* The text of the PREPARE command: take the statement to prepare */
+	if (IsA(rawstmt->stmt, PrepareStmt))
+	{
+		PrepareStmt *stmt = (PrepareStmt *) rawstmt->stmt;
+
+		rawstmt = makeNode(RawStmt);
+		rawstmt->stmt = stmt->query;
+		rawstmt->stmt_location = -1;
+		rawstmt->stmt_len = 0;
+	}
+
+	querytrees = pg_analyze_and_rewrite_fixedparams(rawstmt, query_string,
+													src->paramtypes,
+													src->nparams, NULL);
+
+	cost[PGM_PLAN_GENERIC] = shadow_plan_queries(querytrees, query_string,
+												 NULL,
+												 &plan_time[PGM_PLAN_GENERIC]);
+	if (nparams > 0)
+		params = params_restore(params_buf, nparams);
+	cost[PGM_PLAN_CUSTOM] = shadow_plan_queries(querytrees, query_string,
+												params,
+												&plan_time[PGM_PLAN_CUSTOM]);
+}
+
+/*
+ * Shadow planning of one entry, in its own transaction. Errors are logged
+ * and the statement is marked as planned to not try it again.
+ */
+static void
+shadow_process_entry(uint64 queryId)
+{
+	MentorTblEntry	   *entry;
+	PGMShadowSource	   *src = NULL;
+	char			   *params_buf = NULL;
+	int					nparams = 0;
+	double				plan_time[PGM_PLAN_KINDS] = {-1., -1.};
+	double				cost[PGM_PLAN_KINDS] = {-1., -1.};
+	MemoryContext		oldcxt;
+	ResourceOwner		oldowner;
+
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	oldcxt = CurrentMemoryContext;
+	oldowner = CurrentResourceOwner;
+
+	/* Copy the source and the sample out of shared memory */
+	entry = (MentorTblEntry *) dshash_find(pgm_hash, &queryId, false);
+	if (entry != NULL)
+	{
+		if (DsaPointerIsValid(entry->shadow_source) &&
+			(entry->shadow_nparams == 0 ||
+			 DsaPointerIsValid(entry->shadow_params)))
+		{
+			PGMShadowSource *shared;
+			Size			size;
+
+			shared = dsa_get_address(dsa, entry->shadow_source);
+			size = offsetof(PGMShadowSource, paramtypes) +
+				sizeof(Oid) * shared->nparams + shared->query_len +
+				shared->search_path_len + 2;
+			src = palloc(size);
+			memcpy(src, shared, size);
+			if (entry->shadow_nparams > 0)
+			{
+				params_buf = palloc(entry->shadow_params_len);
+				memcpy(params_buf,
+					   dsa_get_address(dsa, entry->shadow_params),
+					   entry->shadow_params_len);
+				nparams = entry->shadow_nparams;
+			}
+		}
+		dshash_release_lock(pgm_hash, entry);
+	}
+
+	if (src != NULL)
+	{
+		pgstat_report_activity(STATE_RUNNING, SHADOW_SOURCE_QUERY(src));
+
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(oldcxt);
+		PG_TRY();
+		{
+			shadow_plan_statement(src, params_buf, nparams, plan_time, cost);
+			ReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcxt);
+			CurrentResourceOwner = oldowner;
+		}
+		PG_CATCH();
+		{
+			ErrorData  *edata;
+
+			MemoryContextSwitchTo(oldcxt);
+			edata = CopyErrorData();
+			FlushErrorState();
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcxt);
+			CurrentResourceOwner = oldowner;
+
+			ereport(LOG,
+					(errmsg("pg_mentor could not plan statement " UINT64_FORMAT ": %s",
+							queryId, edata->message)));
+			FreeErrorData(edata);
+			cost[PGM_PLAN_GENERIC] = cost[PGM_PLAN_CUSTOM] = -1.;
+		}
+		PG_END_TRY();
+
+		entry = (MentorTblEntry *) dshash_find(pgm_hash, &queryId, true);
+		if (entry != NULL)
+		{
+			entry->shadow_at = GetCurrentTimestamp();
+			memcpy(entry->shadow_plan_time, plan_time, sizeof(plan_time));
+			memcpy(entry->shadow_cost, cost, sizeof(cost));
+			dshash_release_lock(pgm_hash, entry);
+		}
+	}
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+void
+pgm_shadow_main(Datum main_arg)
+{
+	Oid					dbid = DatumGetObjectId(main_arg);
+	Oid					userid;
+	dshash_seq_status	hash_seq;
+	MentorTblEntry	   *entry;
+	uint64			   *keys;
+	int					nkeys = 0;
+	int					maxkeys = 64;
+	int					i;
+
+	memcpy(&userid, MyBgworkerEntry->bgw_extra, sizeof(Oid));
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+	BackgroundWorkerInitializeConnectionByOid(dbid, userid, 0);
+
+	StartTransactionCommand();
+	if (!OidIsValid(get_extension_oid(MODULENAME, true)))
+	{
+		CommitTransactionCommand();
+		proc_exit(0);
+	}
 	pgm_init_shmem();
 
-	entry = (MentorTblEntry *) dshash_find_or_insert(pgm_hash, &queryId, &found);
-	result = pg_mentor_set_plan_mode_int(entry, status, ref_exec_time,
-										 ref_nblocks, fixed);
+	/* Collect statements ready to be planned */
+	keys = (uint64 *) MemoryContextAlloc(TopMemoryContext,
+										 sizeof(uint64) * maxkeys);
+	dshash_seq_init(&hash_seq, pgm_hash, false);
+	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	{
+		if (entry->shadow_at != 0 || !DsaPointerIsValid(entry->shadow_source) ||
+			(entry->shadow_nparams > 0 &&
+			 !DsaPointerIsValid(entry->shadow_params)))
+			continue;
+
+		if (nkeys >= maxkeys)
+		{
+			maxkeys *= 2;
+			keys = (uint64 *) repalloc(keys, sizeof(uint64) * maxkeys);
+		}
+		keys[nkeys++] = entry->queryid;
+	}
+	dshash_seq_term(&hash_seq);
+	CommitTransactionCommand();
+
+	for (i = 0; i < nkeys; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		shadow_process_entry(keys[i]);
+	}
 
-	dshash_release_lock(pgm_hash, entry);
-	PG_RETURN_BOOL(result);
+	proc_exit(0);
 }
 
 /*
- * Return the ring buffer size.
- * It may contain only MENTOR_TBL_ENTRY_STAT_SIZE elements or entry->next_idx
- * elements in case it is not full yet.
+ * Launch the shadow planner for the current database. With wait => true
+ * return when it finishes.
  */
-static int
-ring_buffer_size(MentorTblEntry *entry)
-{
-	if (unlikely(entry->nblocks[entry->next_idx % MENTOR_TBL_ENTRY_STAT_SIZE] < 0))
-		return entry->next_idx;
-	else
-		return MENTOR_TBL_ENTRY_STAT_SIZE;
-}
-
-static ArrayType *
-form_vector_int64(int64 *vector, int nrows)
+Datum
+pg_mentor_shadow_plan(PG_FUNCTION_ARGS)
 {
-	Datum	   *elems;
-	ArrayType  *a;
-	int			lbs = 1;
-	int			i;
-
-	elems = palloc(sizeof(*elems) * nrows);
-	for (i = 0; i < nrows; i++)
-		elems[i] = Int64GetDatum(vector[i]);
-	a = construct_md_array(elems, NULL, 1, &nrows, &lbs, INT8OID, 8, true, 'd');
-	return a;
-}
+	bool					wait = PG_GETARG_BOOL(0);
+	BackgroundWorker		worker = {0};
+	BackgroundWorkerHandle *handle;
+	BgwHandleStatus			status;
+	pid_t					pid;
+	Oid						userid = GetUserId();
 
-static ArrayType *
-form_vector_dbl(double *vector, int nrows)
-{
-	Datum	   *elems;
-	ArrayType  *a;
-	int			lbs = 1;
-	int			i;
+	pgm_init_shmem();
 
-	elems = palloc(sizeof(*elems) * nrows);
-	for (i = 0; i < nrows; i++)
-		elems[i] = Float8GetDatum(vector[i]);
-	a = construct_md_array(elems, NULL, 1, &nrows, &lbs, FLOAT8OID, 8, true, 'd');
-	return a;
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, MAXPGPATH, MODULENAME);
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgm_shadow_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_mentor shadow planner");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_mentor shadow planner");
+	worker.bgw_main_arg = ObjectIdGetDatum(MyDatabaseId);
+	memcpy(worker.bgw_extra, &userid, sizeof(Oid));
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("could not register background process"),
+				 errhint("You may need to increase \"max_worker_processes\".")));
+
+	if (!wait)
+		PG_RETURN_BOOL(true);
+
+	status = WaitForBackgroundWorkerStartup(handle, &pid);
+	if (status == BGWH_STOPPED)
+		PG_RETURN_BOOL(true);
+	if (status != BGWH_STARTED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not start background process"),
+				 errhint("More details may be available in the server log.")));
+
+	status = WaitForBackgroundWorkerShutdown(handle);
+	PG_RETURN_BOOL(status == BGWH_STOPPED);
 }
 
+/*
+ * Results of the shadow planning.
+ */
 Datum
-pg_mentor_show_prepared_statements(PG_FUNCTION_ARGS)
+pg_mentor_show_shadow_plans(PG_FUNCTION_ARGS)
 {
-	int					status = PG_GETARG_INT32(0);
 	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	dshash_seq_status	hash_seq;
 	MentorTblEntry	   *entry;
@@ -419,47 +5176,26 @@ pg_mentor_show_prepared_statements(PG_FUNCTION_ARGS)
 	dshash_seq_init(&hash_seq, pgm_hash, false);
 	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
 	{
-		Datum	values[MENTOR_TBL_ENTRY_FIELDS_NUM] = {0};
-		bool	nulls[MENTOR_TBL_ENTRY_FIELDS_NUM] = {0};
-		int		statnum;
+		Datum	values[6] = {0};
+		bool	nulls[6] = {0};
+		int		kind;
 
-		/* Do we need to skip this record? */
-		if (status >= 0 && status != entry->plan_cache_mode)
+		if (entry->shadow_at == 0)
 			continue;
 
 		values[0] = Int64GetDatumFast((int64) entry->queryid);
-		values[1] = UInt64GetDatum(entry->refcounter);
-		values[2] = Int32GetDatum(entry->plan_cache_mode);
-		values[3] = TimestampTzGetDatum(entry->since);
-		values[4] = BoolGetDatum(entry->fixed);
-
-		statnum = ring_buffer_size(entry);
-		values[5] = Int32GetDatum(statnum);
-		if (statnum == 0)
-		{
-			nulls[6] = nulls[7] = nulls[8] = nulls[9] = true;
-		}
-		else
+		values[1] = TimestampTzGetDatum(entry->shadow_at);
+		for (kind = 0; kind < PGM_PLAN_KINDS; kind++)
 		{
-			values[6] = PointerGetDatum(form_vector_int64(entry->nblocks, statnum));
-			values[7] = PointerGetDatum(form_vector_dbl(entry->times, statnum));
-			values[8] = Float8GetDatum(entry->avg_nblocks);
-			values[9] = Float8GetDatum(entry->avg_exec_time);
+			if (entry->shadow_cost[kind] < 0.)
+			{
+				nulls[2 + kind * 2] = nulls[3 + kind * 2] = true;
+				continue;
+			}
+			values[2 + kind * 2] = Float8GetDatum(entry->shadow_plan_time[kind]);
+			values[3 + kind * 2] = Float8GetDatum(entry->shadow_cost[kind]);
 		}
 
-		if (entry->ref_nblocks > 0)
-			values[10] = Float8GetDatum(entry->ref_nblocks);
-		else
-			nulls[10] = true;
-		if (entry->ref_exec_time > 0.)
-			values[11] = Float8GetDatum(entry->ref_exec_time);
-		else
-			nulls[11] = true;
-		if (entry->plan_time >= 0.)
-			values[12] = Float8GetDatum(entry->plan_time);
-		else
-			nulls[12] = true;
-
 		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
 	}
 	dshash_seq_term(&hash_seq);
@@ -467,150 +5203,501 @@ pg_mentor_show_prepared_statements(PG_FUNCTION_ARGS)
 	return (Datum) 0;
 }
 
-#include "math.h"
+/*
+ * Cluster-wide scheduler.
+ *
+ * With pg_mentor.scheduler on, a launcher started by the postmaster runs the
+ * decision strategy in every database where statements are tracked, so one
+ * configuration replaces a cron job per database. Each cycle the launcher
+ * orders the databases by the activity reported since their last run (a
+ * regression weighs as much as PGM_SCHED_REGRESSION_WEIGHT executions) and
+ * serves them with a pool of dynamic workers. Idle databases aren't visited
+ * at all. Once the workers have spent the cycle budget, the rest of the
+ * databases wait for the next cycle, having the highest priority there.
+ */
+static void
+pgm_sched_init_state(void *ptr)
+{
+	PGMSchedState  *s = (PGMSchedState *) ptr;
+	int				i;
 
-static double
-calculateStandardDeviation(int N, int64 data[])
+	s->tranche_id = LWLockNewTrancheId();
+	LWLockInitialize(&s->lock, s->tranche_id);
+	for (i = 0; i < PGM_SCHED_MAX_DATABASES; i++)
+	{
+		PGMSchedSlot *slot = &s->slots[i];
+
+		slot->dboid = InvalidOid;
+		pg_atomic_init_u64(&slot->nsamples, 0);
+		pg_atomic_init_u64(&slot->nregressions, 0);
+		slot->seen_samples = slot->seen_regressions = 0;
+		slot->nruns = 0;
+		slot->last_run = 0;
+		slot->last_duration = 0.;
+	}
+}
+
+static void
+sched_attach(void)
 {
-    double	sum = 0;
-	double	mean;
-	double	values = 0;
+	bool	found;
 
-    for (int i = 0; i < N; i++)
+	if (sched != NULL)
+		return;
+
+	sched = GetNamedDSMSegment(MODULENAME"-scheduler", sizeof(PGMSchedState),
+							   pgm_sched_init_state, &found);
+	LWLockRegisterTranche(sched->tranche_id, MODULENAME"-scheduler");
+}
+
+/*
+ * Find or take the slot of the current database. Without a free slot the
+ * database isn't scheduled.
+ */
+static void
+sched_claim_slot(void)
+{
+	PGMSchedSlot   *free_slot = NULL;
+	int				i;
+
+	sched_attach();
+
+	LWLockAcquire(&sched->lock, LW_EXCLUSIVE);
+	for (i = 0; i < PGM_SCHED_MAX_DATABASES; i++)
 	{
-        sum += data[i];
-    }
+		PGMSchedSlot *slot = &sched->slots[i];
 
-    mean = sum / N;
-    for (int i = 0; i < N; i++)
+		if (slot->dboid == MyDatabaseId)
+		{
+			sched_slot = slot;
+			break;
+		}
+		if (free_slot == NULL && !OidIsValid(slot->dboid))
+			free_slot = slot;
+	}
+	if (sched_slot == NULL && free_slot != NULL)
 	{
-        values += pow(data[i] - mean, 2);
-    }
+		free_slot->dboid = MyDatabaseId;
+		pg_atomic_write_u64(&free_slot->nsamples, 0);
+		pg_atomic_write_u64(&free_slot->nregressions, 0);
+		free_slot->seen_samples = free_slot->seen_regressions = 0;
+		free_slot->nruns = 0;
+		free_slot->last_run = 0;
+		free_slot->last_duration = 0.;
+		sched_slot = free_slot;
+	}
+	LWLockRelease(&sched->lock);
 
-    return sqrt(values / N);
+	if (sched_slot == NULL)
+		ereport(LOG,
+				(errmsg("no scheduler slot for database %u", MyDatabaseId),
+				 errdetail("At most %d databases are scheduled.",
+						   PGM_SCHED_MAX_DATABASES)));
 }
 
-Datum
-reconsider_ps_modes(PG_FUNCTION_ARGS)
+/*
+ * Report an execution to the scheduler. The shared counter is touched once
+ * per batch, regressions are rare enough to be reported at once.
+ *
+ * The launcher frees slots of dropped databases, so a slot may have changed
+ * hands since we claimed it: claim a slot again then.
+ */
+static inline void
+sched_report(bool regressed)
 {
-	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	dshash_seq_status	hash_seq;
-	MentorTblEntry	   *entry;
-	HeapTuple			tuple;
-	int32				to_generic = 0;
-	int32				to_custom = 0;
-	int32				nvalues = 0;
-	Datum				values[3] = {0};
-	bool				nulls[3] = {0};
-	double				stddev;
+	if (sched_slot == NULL)
+		return;
 
-	pgm_init_shmem();
+	if (unlikely(sched_slot->dboid != MyDatabaseId))
+	{
+		sched_slot = NULL;
+		sched_pending = 0;
+		sched_claim_slot();
+		if (sched_slot == NULL)
+			return;
+	}
 
-//	InitMaterializedSRF(fcinfo, 0);
+	if (unlikely(regressed))
+		pg_atomic_fetch_add_u64(&sched_slot->nregressions, 1);
+	if (++sched_pending >= PGM_SCHED_REPORT_BATCH)
+	{
+		pg_atomic_fetch_add_u64(&sched_slot->nsamples, sched_pending);
+		sched_pending = 0;
+	}
+}
 
-	dshash_seq_init(&hash_seq, pgm_hash, false);
-	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+/*
+ * Run the strategy in the database given.
+ */
+void
+pgm_scheduler_worker_main(Datum main_arg)
+{
+	Oid			dbid = DatumGetObjectId(main_arg);
+	TimestampTz	start;
+	int32		to_generic = 0;
+	int32		to_custom = 0;
+	int32		nvalues = 0;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+	BackgroundWorkerInitializeConnectionByOid(dbid, InvalidOid, 0);
+
+	start = GetCurrentTimestamp();
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	if (OidIsValid(get_extension_oid(MODULENAME, true)))
+	{
+		pgm_init_shmem();
+		if (pgm_history_buckets > 0)
+			apply_schedule();
+		reconsider_run(NULL, &to_generic, &to_custom, &nvalues);
+	}
+	CommitTransactionCommand();
+
+	ereport(DEBUG1,
+			(errmsg("pg_mentor scheduler: %d statements reconsidered, %d switched to generic, %d to custom plans",
+					nvalues, to_generic, to_custom)));
+
+	if (sched_slot != NULL)
+	{
+		LWLockAcquire(&sched->lock, LW_EXCLUSIVE);
+		sched_slot->last_duration = (double)
+			TimestampDifferenceMilliseconds(start, GetCurrentTimestamp());
+		LWLockRelease(&sched->lock);
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * Databases the scheduler may connect to. Allocated in the caller's context.
+ */
+static List *
+sched_database_list(void)
+{
+	MemoryContext	cxt = CurrentMemoryContext;
+	List		   *dbs = NIL;
+	Relation		rel;
+	TableScanDesc	scan;
+	HeapTuple		tup;
+
+	StartTransactionCommand();
+	(void) GetTransactionSnapshot();
+
+	rel = table_open(DatabaseRelationId, AccessShareLock);
+	scan = table_beginscan_catalog(rel, 0, NULL);
+	while (HeapTupleIsValid(tup = heap_getnext(scan, ForwardScanDirection)))
 	{
-		int	statnum = ring_buffer_size(entry);
+		Form_pg_database	db = (Form_pg_database) GETSTRUCT(tup);
+		MemoryContext		oldcxt;
+
+		if (!db->datallowconn)
+			continue;
+
+		oldcxt = MemoryContextSwitchTo(cxt);
+		dbs = lappend_oid(dbs, db->oid);
+		MemoryContextSwitchTo(oldcxt);
+	}
+	table_endscan(scan);
+	table_close(rel, AccessShareLock);
+
+	CommitTransactionCommand();
+	MemoryContextSwitchTo(cxt);
+	return dbs;
+}
+
+typedef struct SchedCandidate
+{
+	PGMSchedSlot   *slot;
+	Oid				dboid;
+	uint64			nsamples; /* counters to remember as seen on launch */
+	uint64			nregressions;
+	double			priority;
+} SchedCandidate;
+
+static int
+sched_candidate_cmp(const void *a, const void *b)
+{
+	const SchedCandidate *ca = (const SchedCandidate *) a;
+	const SchedCandidate *cb = (const SchedCandidate *) b;
+
+	if (ca->priority > cb->priority)
+		return -1;
+	if (ca->priority < cb->priority)
+		return 1;
+	return 0;
+}
+
+static BackgroundWorkerHandle *
+sched_launch_worker(Oid dboid)
+{
+	BackgroundWorker		worker = {0};
+	BackgroundWorkerHandle *handle;
+
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, MAXPGPATH, MODULENAME);
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgm_scheduler_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_mentor worker for database %u",
+			 dboid);
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_mentor worker");
+	worker.bgw_main_arg = ObjectIdGetDatum(dboid);
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		return NULL;
+	return handle;
+}
 
-		nvalues++;
+/*
+ * One pass over the registry: choose databases with new activity and serve
+ * them with the pool of workers until the budget of the cycle is spent.
+ */
+static void
+sched_run_cycle(void)
+{
+	List					*dbs = sched_database_list();
+	TimestampTz				 now = GetCurrentTimestamp();
+	List					*missing = NIL;
+	SchedCandidate			*cands;
+	BackgroundWorkerHandle **pool;
+	TimestampTz				*started;
+	int						 nworkers = pgm_scheduler_max_workers;
+	int						 ncands = 0;
+	int						 nrunning = 0;
+	int						 next = 0;
+	double					 spent = 0.;
+	int						 i;
+
+	cands = palloc(sizeof(SchedCandidate) * PGM_SCHED_MAX_DATABASES);
+
+	LWLockAcquire(&sched->lock, LW_EXCLUSIVE);
+	for (i = 0; i < PGM_SCHED_MAX_DATABASES; i++)
+	{
+		PGMSchedSlot   *slot = &sched->slots[i];
+		SchedCandidate *c = &cands[ncands];
 
-		/* Do we need to skip this record? */
-		if (entry->plan_cache_mode < 0)
+		if (!OidIsValid(slot->dboid))
 			continue;
 
-		if (entry->avg_nblocks <= 0. || statnum <= 1)
+		/* The database may have been dropped, see below */
+		if (!list_member_oid(dbs, slot->dboid))
+		{
+			missing = lappend_oid(missing, slot->dboid);
 			continue;
+		}
+
+		c->slot = slot;
+		c->dboid = slot->dboid;
+		c->nsamples = pg_atomic_read_u64(&slot->nsamples);
+		c->nregressions = pg_atomic_read_u64(&slot->nregressions);
+		c->priority = (double) (c->nsamples - slot->seen_samples) +
+			PGM_SCHED_REGRESSION_WEIGHT *
+			(double) (c->nregressions - slot->seen_regressions);
+
+		/* Visit idle databases too once an hour to apply their schedules */
+		if (pgm_history_buckets > 0 &&
+			slot->last_run / USECS_PER_HOUR != now / USECS_PER_HOUR)
+			c->priority = Max(c->priority, 1.);
+
+		if (c->priority > 0.)
+			ncands++;
+	}
+	LWLockRelease(&sched->lock);
 
-		stddev = calculateStandardDeviation(statnum, entry->nblocks);
+	/*
+	 * A database created after the list has been read may have claimed its
+	 * slot already. Free a slot only if its database is missing from a list
+	 * read after the slot has been seen.
+	 */
+	if (missing != NIL)
+	{
+		List   *current = sched_database_list();
 
-		/* Step 1: auto-mode => generic */
-		if (entry->plan_cache_mode == 0 && !entry->fixed &&
-			entry->ref_exec_time < 0. &&
-			entry->avg_exec_time < entry->plan_time &&
-			stddev / entry->avg_nblocks <= 0.3)
+		LWLockAcquire(&sched->lock, LW_EXCLUSIVE);
+		for (i = 0; i < PGM_SCHED_MAX_DATABASES; i++)
 		{
-			pg_mentor_set_plan_mode_int(entry, 1, -1, -1, false);
-			to_generic++;
+			PGMSchedSlot *slot = &sched->slots[i];
+
+			if (OidIsValid(slot->dboid) &&
+				list_member_oid(missing, slot->dboid) &&
+				!list_member_oid(current, slot->dboid))
+				slot->dboid = InvalidOid;
 		}
-		/* Step 2: */
-		else if (entry->plan_cache_mode == 1 && !entry->fixed &&
-			entry->ref_exec_time > 0. &&
-			entry->avg_exec_time < entry->plan_time * 2.0 &&
-			entry->avg_nblocks/entry->ref_nblocks > 1.0)
+		LWLockRelease(&sched->lock);
+	}
+
+	qsort(cands, ncands, sizeof(SchedCandidate), sched_candidate_cmp);
+
+	pool = palloc0(sizeof(BackgroundWorkerHandle *) * nworkers);
+	started = palloc0(sizeof(TimestampTz) * nworkers);
+	for (;;)
+	{
+		for (i = 0; i < nworkers && next < ncands; i++)
 		{
-			pg_mentor_set_plan_mode_int(entry, 2, -1, -1, false);
-			to_custom++;
+			SchedCandidate *c = &cands[next];
+
+			if (pool[i] != NULL)
+				continue;
+
+			if (pgm_scheduler_cycle_budget > 0 &&
+				spent >= pgm_scheduler_cycle_budget)
+			{
+				next = ncands;
+				break;
+			}
+
+			pool[i] = sched_launch_worker(c->dboid);
+			if (pool[i] == NULL)
+			{
+				/* No free worker slots: try again in the next cycle */
+				ereport(LOG,
+						(errmsg("could not start pg_mentor worker"),
+						 errhint("You may need to increase \"max_worker_processes\".")));
+				next = ncands;
+				break;
+			}
+
+			started[i] = GetCurrentTimestamp();
+			nrunning++;
+			next++;
+
+			LWLockAcquire(&sched->lock, LW_EXCLUSIVE);
+			if (c->slot->dboid == c->dboid)
+			{
+				c->slot->seen_samples = c->nsamples;
+				c->slot->seen_regressions = c->nregressions;
+				c->slot->nruns++;
+				c->slot->last_run = started[i];
+			}
+			LWLockRelease(&sched->lock);
 		}
-		/* Step 3: auto-mode => custom */
-		else if (entry->plan_cache_mode == 0 && !entry->fixed &&
-			entry->ref_exec_time <= 0. &&
-			entry->avg_exec_time > entry->plan_time * 1.0 &&
-			stddev / entry->avg_nblocks > 0.5)
+
+		if (nrunning == 0)
+			break;
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 1000L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		for (i = 0; i < nworkers; i++)
 		{
-			pg_mentor_set_plan_mode_int(entry, 2, -1, -1, false);
-			to_custom++;
+			pid_t	pid;
+
+			if (pool[i] == NULL ||
+				GetBackgroundWorkerPid(pool[i], &pid) != BGWH_STOPPED)
+				continue;
+
+			spent += (double) TimestampDifferenceMilliseconds(started[i],
+															  GetCurrentTimestamp());
+			pfree(pool[i]);
+			pool[i] = NULL;
+			nrunning--;
 		}
-		/* Step 4: 'custom' => 'generic' */
-		else if (entry->plan_cache_mode == 2 && !entry->fixed &&
-			entry->ref_exec_time > 0. &&
-			(entry->avg_exec_time < entry->plan_time * 2.0 ||
-			entry->ref_nblocks / entry->avg_nblocks < 2.0) &&
-			stddev / entry->avg_nblocks <= 0.3)
+	}
+}
+
+void
+pgm_scheduler_main(Datum main_arg)
+{
+	MemoryContext	cycle_cxt;
+	TimestampTz		next_cycle;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	/* Only shared catalogs are needed */
+	BackgroundWorkerInitializeConnection(NULL, NULL, 0);
+	sched_attach();
+
+	cycle_cxt = AllocSetContextCreate(TopMemoryContext,
+									  "pg_mentor scheduler cycle",
+									  ALLOCSET_DEFAULT_SIZES);
+	next_cycle = TimestampTzPlusSeconds(GetCurrentTimestamp(),
+										pgm_scheduler_naptime);
+	for (;;)
+	{
+		long	timeout;
+
+		timeout = TimestampDifferenceMilliseconds(GetCurrentTimestamp(),
+												  next_cycle);
+		if (timeout > 0)
 		{
-			pg_mentor_set_plan_mode_int(entry, 1, -1, -1, false);
-			to_generic++;
+			(void) WaitLatch(MyLatch,
+							 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+							 timeout, PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
 		}
-		else
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
 		{
-			/* Skip the record */
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
 		}
-	}
-	dshash_seq_term(&hash_seq);
 
-	values[0] = Int32GetDatum(to_generic);
-	values[1] = Int32GetDatum(to_custom);
-	values[2] = Int32GetDatum(nvalues - to_generic - to_custom);
+		if (GetCurrentTimestamp() < next_cycle)
+			continue;
 
-	tuple = heap_form_tuple(rsinfo->expectedDesc, values, nulls);
-	return HeapTupleGetDatum(tuple);
-}
+		MemoryContextSwitchTo(cycle_cxt);
+		sched_run_cycle();
+		MemoryContextSwitchTo(TopMemoryContext);
+		MemoryContextReset(cycle_cxt);
 
+		next_cycle = TimestampTzPlusSeconds(GetCurrentTimestamp(),
+											pgm_scheduler_naptime);
+	}
+}
 
 /*
- * Clean all decisions has been made
+ * Databases known to the scheduler and their activity since the last run.
  */
 Datum
-pg_mentor_reset(PG_FUNCTION_ARGS)
+pg_mentor_show_scheduler(PG_FUNCTION_ARGS)
 {
-	dshash_seq_status	hash_seq;
-	MentorTblEntry	   *entry;
-	int32				counter = 0;
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	int				i;
 
-	pgm_init_shmem();
+	InitMaterializedSRF(fcinfo, 0);
 
-	dshash_seq_init(&hash_seq, pgm_hash, true);
-	while ((entry = dshash_seq_next(&hash_seq)) != NULL)
+	if (!pgm_scheduler)
+		return (Datum) 0;
+
+	sched_attach();
+
+	LWLockAcquire(&sched->lock, LW_SHARED);
+	for (i = 0; i < PGM_SCHED_MAX_DATABASES; i++)
 	{
-		int i;
+		PGMSchedSlot   *slot = &sched->slots[i];
+		Datum			values[6] = {0};
+		bool			nulls[6] = {0};
 
-		entry->plan_cache_mode = 0;
-		entry->fixed = false;
-		entry->ref_exec_time = -1;
-		entry->since = 0;
-		entry->next_idx = 0;
-		entry->ref_exec_time = -1.0;
-		entry->ref_nblocks = -1.;
-		entry->avg_exec_time = 0.;
-		entry->avg_nblocks = 0.;
-		counter++;
-		for (i = 0; i < MENTOR_TBL_ENTRY_STAT_SIZE; i++)
-			entry->nblocks[i] = -1;
-		for (i = 0; i < MENTOR_TBL_ENTRY_STAT_SIZE; i++)
-			entry->times[i] = -1;
+		if (!OidIsValid(slot->dboid))
+			continue;
+
+		values[0] = ObjectIdGetDatum(slot->dboid);
+		values[1] = Int64GetDatum(pg_atomic_read_u64(&slot->nsamples) -
+								  slot->seen_samples);
+		values[2] = Int64GetDatum(pg_atomic_read_u64(&slot->nregressions) -
+								  slot->seen_regressions);
+		values[3] = Int64GetDatum(slot->nruns);
+		if (slot->last_run != 0)
+		{
+			values[4] = TimestampTzGetDatum(slot->last_run);
+			values[5] = Float8GetDatum(slot->last_duration);
+		}
+		else
+			nulls[4] = nulls[5] = true;
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
 	}
-	dshash_seq_term(&hash_seq);
-	PG_RETURN_INT32(counter);
+	LWLockRelease(&sched->lock);
+
+	return (Datum) 0;
 }
 
 static void
@@ -620,6 +5707,19 @@ pgm_init_state(void *ptr)
 
 	state->tranche_id = LWLockNewTrancheId();
 	pg_atomic_init_u64(&state->state_decisions, 1);
+	for (int i = 0; i < PGM_COUNTERS_NUM; i++)
+		pg_atomic_init_u64(&state->counters[i], 0);
+	pg_atomic_init_u32(&state->noverrides, 0);
+	pg_atomic_init_u64(&state->schedule_hour, 0);
+	pg_atomic_init_flag(&state->schedule_busy);
+	pg_atomic_init_u64(&state->pins_generation, 1);
+	pg_atomic_init_u64(&state->pins_applied, 0);
+	pg_atomic_init_flag(&state->pins_busy);
+	LWLockInitialize(&state->outliers_lock, state->tranche_id);
+	state->outliers = InvalidDsaPointer;
+	state->outliers_next = 0;
+	SpinLockInit(&state->calib_lock);
+	memset(state->calib, 0, sizeof(state->calib));
 	state->dbOid = MyDatabaseId;
 	Assert(OidIsValid(state->dbOid));
 
@@ -628,10 +5728,13 @@ pgm_init_state(void *ptr)
 	dsa_pin_mapping(dsa);
 	dsh_params.tranche_id = state->tranche_id;
 	pgm_hash = dshash_create(dsa, &dsh_params, NULL);
+	shapes_dsh_params.tranche_id = state->tranche_id;
+	pgm_shapes = dshash_create(dsa, &shapes_dsh_params, NULL);
 
 	/* Store handles in shared memory for other backends to use. */
 	state->dsah = dsa_get_handle(dsa);
 	state->dshh = dshash_get_hash_table_handle(pgm_hash);
+	state->shapes_dshh = dshash_get_hash_table_handle(pgm_shapes);
 }
 
 /*
@@ -664,31 +5767,92 @@ pgm_init_shmem(void)
 		dsa = dsa_attach(state->dsah);
 		dsa_pin_mapping(dsa);
 		pgm_hash = dshash_attach(dsa, &dsh_params, state->dshh, NULL);
+		pgm_shapes = dshash_attach(dsa, &shapes_dsh_params, state->shapes_dshh,
+								   NULL);
 	}
 	LWLockRegisterTranche(state->tranche_id, segment_name);
 
+	if (pgm_scheduler)
+		sched_claim_slot();
+
 	MemoryContextSwitchTo(memctx);
-	Assert(dsa != NULL && pgm_hash != NULL);
+	Assert(dsa != NULL && pgm_hash != NULL && pgm_shapes != NULL);
 	return found;
 }
 
 static void
 pgm_post_parse_analyze(ParseState *pstate, Query *query, JumbleState *jstate)
 {
+	Oid		extoid;
+
 	/* Call in advance. If something triggers an error we skip further code */
 	if (prev_post_parse_analyze_hook)
 		(*prev_post_parse_analyze_hook) (pstate, query, jstate);
 
-	if (!IsTransactionState() || !get_extension_oid(MODULENAME, true))
+	if (!OidIsValid(extoid = pgm_extension_oid()))
 		/*
 		 * Our extension doesn't exist in the database the backend is
 		 * registered in, do nothing.
 		 */
 		return;
 
-	pgm_init_shmem();
+	/*
+	 * Nothing to report or apply decisions to: statements with pending
+	 * registrations are in the local table too. Pins and schedules are
+	 * applied by backends that have prepared statements.
+	 */
+	if (!pgm_any_tracked())
+		return;
+
+	pgm_init_shmem();
+
+	check_pins(extoid);
+
+	/*
+	 * Any statement but PREPARE/DEALLOCATE may be an execution of a prepared
+	 * one: report registrations accumulated during warm-up so that decisions
+	 * could be applied to them. Statements analysed inside a PREPARE don't
+	 * count.
+	 */
+	if (!pgm_preparing &&
+		!(query->commandType == CMD_UTILITY &&
+		  (IsA(query->utilityStmt, PrepareStmt) ||
+		   IsA(query->utilityStmt, DeallocateStmt))))
+		flush_registrations();
+
+	/* Without the scheduler, schedules are applied by backends themselves */
+	if (pgm_history_buckets > 0 && !pgm_scheduler)
+		apply_schedule();
+
+	check_state();
+}
+
+/* Are planner settings overridden for any statement? */
+static inline bool
+pgm_has_overrides(void)
+{
+	if (unlikely(!pgm_overrides_valid))
+	{
+		pgm_init_shmem();
+		pgm_overrides = (pg_atomic_read_u32(&state->noverrides) > 0);
+		pgm_overrides_valid = true;
+	}
+	return pgm_overrides;
+}
+
+/*
+ * Does the planner hook have anything to do? Only prepared statements are
+ * tracked, but planner settings may be overridden for any queryId.
+ */
+static inline bool
+pgm_planner_tracks(void)
+{
+	if (!OidIsValid(pgm_extension_oid()))
+		return false;
+	if (pgm_any_tracked())
+		return true;
 
-	check_state();
+	return pgm_has_overrides();
 }
 
 static PlannedStmt *
@@ -698,14 +5862,25 @@ pgm_planner(Query *parse, const char *query_string,
 	PlannedStmt *result;
 
 	if (pgm_enabled(nesting_level) && query_string
-		&& parse->queryId != INT64CONST(0) &&
-		get_extension_oid(MODULENAME, true))
+		&& parse->queryId != INT64CONST(0) && pgm_planner_tracks())
 	{
-		instr_time	start;
-		instr_time	duration;
-		bool			found;
+		uint64			start;
+		double			duration;
+		int				save_nestlevel = 0;
+		LocaLPSEntry   *le;
+		MentorTblEntry *entry;
+
+		pgm_init_shmem();
 
-		INSTR_TIME_SET_CURRENT(start);
+		/*
+		 * Statement-specific planner settings. Check the flag first to
+		 * avoid the table lookup if nobody uses the feature. On error the
+		 * nest level is cleaned up by the (sub)transaction abort.
+		 */
+		if (pgm_has_overrides())
+			save_nestlevel = apply_planner_settings(parse->queryId);
+
+		start = pgm_time_now();
 
 		nesting_level++;
 		PG_TRY();
@@ -723,23 +5898,25 @@ pgm_planner(Query *parse, const char *query_string,
 		}
 		PG_END_TRY();
 
-		INSTR_TIME_SET_CURRENT(duration);
-		INSTR_TIME_SUBTRACT(duration, start);
+		duration = pgm_time_diff_ms(start, pgm_time_now());
 
-		pgm_init_shmem();
+		if (save_nestlevel > 0)
+			AtEOXact_GUC(true, save_nestlevel);
+
+		flush_registrations();
 		check_state();
 
 		/* Be gentle and track queries are known as prepared statements */
-		(void) hash_search(pgm_local_hash, &result->queryId, HASH_FIND, &found);
-		if (found)
+		le = (LocaLPSEntry *) hash_search(pgm_local_hash, &result->queryId,
+										  HASH_FIND, NULL);
+		if (le != NULL && (entry = local_entry_shared(le)) != NULL)
 		{
-			MentorTblEntry *entry;
-
-			entry = (MentorTblEntry *) dshash_find(pgm_hash, &result->queryId,
-												   true);
-			Assert(entry != NULL);
-			entry->plan_time = INSTR_TIME_GET_MILLISEC(duration);
-			dshash_release_lock(pgm_hash, entry);
+			LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+			entry->plan_time = duration;
+			entry->plans++;
+			entry->total_plan_time += duration;
+			entry->last_planned = GetCurrentStatementStartTimestamp();
+			LWLockRelease(&entry->lock);
 		}
 	}
 	else
@@ -790,7 +5967,7 @@ before_backend_shutdown(int code, Datum arg)
 	if (state == NULL)
 		return;
 
-	on_deallocate(UINT64CONST(0));
+	on_deallocate(UINT64CONST(0), NULL);
 }
 
 static void
@@ -805,70 +5982,199 @@ recreate_local_htab()
 	ctl.entrysize = sizeof(LocaLPSEntry);
 	pgm_local_hash = hash_create("pg_mentor PS hash", 128, &ctl,
 								 HASH_ELEM | HASH_BLOBS);
+	pgm_npending = 0;
 }
 
-static uint32
-on_prepare(PreparedStatement *ps)
+/*
+ * Register a new prepared statement.
+ *
+ * Only the backend-local table is touched here: connection poolers and
+ * drivers prepare hundreds of statements right after connecting, and
+ * inserting each of them into the shared table would make all the backends
+ * fight for its partition locks. Registrations are reported to the shared
+ * table in one pass by flush_registrations().
+ */
+static void
+on_prepare(PreparedStatement *ps, double prepare_time)
 {
 	uint64				queryId = get_prepared_stmt_queryId(ps);
-	MentorTblEntry	   *entry;
 	LocaLPSEntry	   *lentry;
 	bool				found;
-	bool				found1;
-	uint32				refcounter;
+	MemoryContext		oldcxt;
 
 	if (queryId == UINT64CONST(0))
-		return -1;
-
-	entry = (MentorTblEntry *) dshash_find_or_insert(pgm_hash, &queryId, &found);
-
-	if (found)
-		entry->refcounter++;
-	else
-	{
-		int i;
-
-		/* Initialise new entry */
-		entry->refcounter = 1;
-		entry->plan_cache_mode = get_plan_cache_mode(ps);
-		entry->since = GetCurrentTimestamp();
-		entry->ref_exec_time = -1.0;
-		entry->next_idx = 0;
-		entry->ref_nblocks = -1.;
-		entry->avg_nblocks = 0.;
-		entry->avg_exec_time = 0.;
-		for (i = 0; i < MENTOR_TBL_ENTRY_STAT_SIZE; i++)
-			entry->nblocks[i] = -1;
-		for (i = 0; i < MENTOR_TBL_ENTRY_STAT_SIZE; i++)
-			entry->times[i] = -1;
-	}
-	refcounter = entry->refcounter;
-	dshash_release_lock(pgm_hash, entry);
+		return;
 
-	/* Don't forget to insert it locally */
 	lentry = (LocaLPSEntry *) hash_search(pgm_local_hash,
-										  &queryId, HASH_ENTER, &found1);
-	if (!found1)
+										  &queryId, HASH_ENTER, &found);
+	if (!found)
 	{
-		lentry->refcounter = 1;
+		lentry->refcounter = 0;
 		lentry->plan_time = -1.;
+		lentry->plansources = NIL;
+		lentry->pending_refs = 0;
+		lentry->pending_prepares = 0;
+		lentry->pending_deallocates = 0;
+		lentry->pending_prepare_time = 0.;
+		lentry->shared = NULL;
 	}
-	else
-		lentry->refcounter++;
 
-	/* If the entry doesn't exist in global entry it can't be in the local one */
-	Assert(!(!found && found1));
+	if (lentry->pending_prepares == 0)
+		pgm_npending++;
 
-	/* Don't trust to big numbers */
-	Assert(refcounter < UINT32_MAX - 1);
+	lentry->refcounter++;
+	lentry->pending_refs++;
+	lentry->pending_prepares++;
+	lentry->pending_prepare_time += prepare_time;
+
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+	lentry->plansources = lappend(lentry->plansources, ps->plansource);
+	MemoryContextSwitchTo(oldcxt);
 
 	if (!before_shmem_exit_initialised)
 	{
 		before_shmem_exit(before_backend_shutdown, 0);
 		before_shmem_exit_initialised = true;
 	}
+}
+
+/*
+ * Report counters of pending registrations to the shared entry.
+ */
+static void
+entry_add_registrations(MentorTblEntry *entry, LocaLPSEntry *le)
+{
+	uint32	refcounter;
+
+	refcounter = pg_atomic_add_fetch_u32(&entry->refcounter, le->pending_refs);
+	pg_atomic_fetch_add_u64(&entry->prepares, le->pending_prepares);
+	pg_atomic_fetch_add_u64(&entry->deallocates, le->pending_deallocates);
+	pg_atomic_fetch_add_u64(&entry->prepare_time,
+							(uint64) (le->pending_prepare_time * NS_PER_MS));
+
+	/* Don't trust to big numbers */
+	Assert(refcounter < UINT32_MAX - 1);
+	(void) refcounter;
+}
+
+typedef struct PendingEntry
+{
+	uint32			hash;
+	LocaLPSEntry   *le;
+} PendingEntry;
+
+static int
+pending_entry_cmp(const void *a, const void *b)
+{
+	const PendingEntry *pa = (const PendingEntry *) a;
+	const PendingEntry *pb = (const PendingEntry *) b;
+
+	return pg_cmp_u32(pa->hash, pb->hash);
+}
+
+/*
+ * Report pending registrations to the shared table.
+ *
+ * dshash chooses the partition by the high bits of the key hash, so entries
+ * are sorted by the hash to pass through each partition once. Decisions
+ * already made for the queryId are applied to the new plan sources here, so
+ * the flush must happen before the first plan is built.
+ */
+static void
+flush_registrations(void)
+{
+	HASH_SEQ_STATUS		hash_seq;
+	PendingEntry	   *pending;
+	LocaLPSEntry	   *le;
+	int					npending = 0;
+	int					i;
+
+	if (pgm_npending == 0)
+		return;
+
+	pending = palloc(sizeof(PendingEntry) * pgm_npending);
+	hash_seq_init(&hash_seq, pgm_local_hash);
+	while ((le = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (le->pending_prepares == 0)
+			continue;
+
+		Assert(npending < pgm_npending);
+		pending[npending].hash = dshash_memhash(&le->queryId, sizeof(uint64),
+												NULL);
+		pending[npending].le = le;
+		npending++;
+	}
+	Assert(npending == pgm_npending);
+
+	qsort(pending, npending, sizeof(PendingEntry), pending_entry_cmp);
+
+	for (i = 0; i < npending; i++)
+	{
+		MentorTblEntry *entry;
+		ListCell	   *lc;
+		bool			found;
+
+		le = pending[i].le;
+
+		/* Known entry: the partition lock isn't needed */
+		if (le->shared != NULL)
+		{
+			entry = le->shared;
+			foreach(lc, le->plansources)
+				set_plan_cache_mode((CachedPlanSource *) lfirst(lc),
+									entry->plan_cache_mode);
+			entry_add_registrations(entry, le);
+			goto next;
+		}
+
+		entry = (MentorTblEntry *) dshash_find_or_insert(pgm_hash,
+														 &le->queryId, &found);
+		if (!found)
+		{
+			if (le->plansources != NIL)
+			{
+				CachedPlanSource *plansource = linitial(le->plansources);
+
+				entry_init(entry, get_plan_cache_mode(plansource));
+				entry_set_relids(entry, plansource->relationOids);
+				if (pgm_shape_pooling)
+					shape_register(entry, plansource);
+				if (pgm_shadow_planning)
+					shadow_register(entry, plansource);
+			}
+			else
+				entry_init(entry, 0);
+		}
+
+		if (found || entry->shape != 0)
+		{
+			foreach(lc, le->plansources)
+				set_plan_cache_mode((CachedPlanSource *) lfirst(lc),
+									entry->plan_cache_mode);
+		}
+		dshash_release_lock(pgm_hash, entry);
+
+		entry_add_registrations(entry, le);
+		le->shared = entry;
+
+next:
+		le->pending_refs = 0;
+		le->pending_prepares = 0;
+		le->pending_deallocates = 0;
+		le->pending_prepare_time = 0.;
+
+		/* All its statements are already deallocated */
+		if (le->refcounter == 0)
+		{
+			Assert(le->plansources == NIL);
+			(void) hash_search(pgm_local_hash, &le->queryId, HASH_REMOVE, NULL);
+		}
+	}
 
-	return refcounter;
+	pgm_npending = 0;
+	pgm_count(PGM_COUNTER_FLUSH);
+	pfree(pending);
 }
 
 /*
@@ -878,7 +6184,7 @@ on_prepare(PreparedStatement *ps)
  * Remove the record from the local HTAB.
  */
 static void
-on_deallocate(uint64 queryId)
+on_deallocate(uint64 queryId, CachedPlanSource *plansource)
 {
 	MentorTblEntry	   *entry;
 	LocaLPSEntry	   *le;
@@ -888,29 +6194,38 @@ on_deallocate(uint64 queryId)
 	{
 		le = (LocaLPSEntry *) hash_search(pgm_local_hash,
 										  &queryId, HASH_FIND, &found);
+
+		/* The statement could be prepared before the extension creation */
+		if (!found)
+			return;
+
+		le->plansources = list_delete_ptr(le->plansources, plansource);
 		le->refcounter--;
-		if (le->refcounter == 0)
-			(void) hash_search(pgm_local_hash, &queryId, HASH_REMOVE, NULL);
 
-		if (found)
+		/* Not reported yet, the shared table doesn't need to know */
+		if (le->pending_refs > 0)
 		{
-			entry = (MentorTblEntry *) dshash_find(pgm_hash, &queryId, true);
-			if (entry != NULL)
-			{
-				entry->refcounter--;
-				Assert(entry->refcounter < UINT32_MAX - 1);
+			le->pending_refs--;
+			le->pending_deallocates++;
+			return;
+		}
 
-				dshash_release_lock(pgm_hash, entry);
-			}
-			else
-			{
-				/* XXX: Is this possible? */
-			}
+		entry = local_entry_shared(le);
 
+		if (le->refcounter == 0 && le->pending_prepares == 0)
+		{
+			list_free(le->plansources);
+			(void) hash_search(pgm_local_hash, &queryId, HASH_REMOVE, NULL);
 		}
-		else
+
+		if (entry != NULL)
 		{
-			/* XXX: Is this possible? */
+			uint32	refcounter;
+
+			refcounter = pg_atomic_sub_fetch_u32(&entry->refcounter, 1);
+			pg_atomic_fetch_add_u64(&entry->deallocates, 1);
+			Assert(refcounter < UINT32_MAX - 1);
+			(void) refcounter;
 		}
 	}
 	else
@@ -919,40 +6234,56 @@ on_deallocate(uint64 queryId)
 
 		/*
 		 * Remove each prepared statement, registered in this backend.
+		 * Report pending registrations first to keep the counters consistent.
 		 */
+		flush_registrations();
 
 		hash_seq_init(&hash_seq, pgm_local_hash);
 		while ((le = hash_seq_search(&hash_seq)) != NULL)
 		{
 			Assert(le->queryId != UINT64CONST(0));
 
-			entry = (MentorTblEntry *) dshash_find(pgm_hash, &le->queryId, true);
+			entry = (le->refcounter > 0) ? local_entry_shared(le) : NULL;
 			if (entry != NULL)
 			{
-				entry->refcounter -= le->refcounter;
-				Assert(entry->refcounter < UINT32_MAX - 1);
+				uint32	refcounter;
 
-				dshash_release_lock(pgm_hash, entry);
-			}
-			else
-			{
-				/* XXX: Is this possible? */
+				refcounter = pg_atomic_sub_fetch_u32(&entry->refcounter,
+													 le->refcounter);
+				pg_atomic_fetch_add_u64(&entry->deallocates, le->refcounter);
+				Assert(refcounter < UINT32_MAX - 1);
+				(void) refcounter;
 			}
 
 			/*
 			 * Sometimes we may not find this entry in global HTAB having in the
 			 * local one (reset). But still should delete it locally.
 			 */
+			list_free(le->plansources);
 			(void) hash_search(pgm_local_hash, &le->queryId, HASH_REMOVE, NULL);
 		}
 	}
 }
 
 static void
-on_execute(uint64 queryId, BufferUsage *bufusage, double exec_time)
+on_execute(uint64 queryId, MentorTblEntry *entry, BufferUsage *bufusage,
+		   uint64 rows, PGMPlanKind plan_kind, double *phase_times,
+		   ParamListInfo params, double cost)
 {
-	MentorTblEntry	   *entry;
+	PGMPhaseStats	   *phases;
+	double				exec_time;
 	int64				nblocks;
+	uint16			   *ring_nblocks;
+	uint16			   *ring_times;
+	uint16			   *ring_rows;
+	uint16				nblocks_code;
+	uint16				time_code;
+	int					idx;
+	uint64				shape;
+	double				plan_time;
+	double				threshold;
+	bool				need_sample;
+	bool				regressed = false;
 
 	if (queryId == UINT64CONST(0))
 		return;
@@ -961,36 +6292,144 @@ on_execute(uint64 queryId, BufferUsage *bufusage, double exec_time)
 				bufusage->local_blks_hit +bufusage->local_blks_read +
 				bufusage->temp_blks_read;
 
-	entry = (MentorTblEntry *) dshash_find(pgm_hash, &queryId, true);
-	Assert(entry != NULL);
-	Assert(ring_buffer_size(entry) <= MENTOR_TBL_ENTRY_STAT_SIZE);
+	/* Execution time is the time spent in ExecutorRun and ExecutorFinish */
+	exec_time = phase_times[PGM_PHASE_RUN] + phase_times[PGM_PHASE_FINISH];
+
+	/*
+	 * Averages are computed over the decoded values: a sample subtracted on
+	 * eviction must be the same as the one added, or the error accumulates.
+	 */
+	nblocks_code = sample_encode((uint64) nblocks);
+	time_code = sample_encode_time(exec_time);
+
+	/* Resolved at the executor start: no shared table lookup in most cases */
+	if (entry == NULL)
+		entry = shared_entry_lookup(queryId);
+	if (entry == NULL)
+		return;
+
+	LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+	Assert(ring_buffer_size(entry) <= pgm_sample_window);
+
+	ring_nblocks = ENTRY_NBLOCKS(entry);
+	ring_times = ENTRY_TIMES(entry);
+	ring_rows = ENTRY_ROWS(entry);
+	idx = entry->next_idx % pgm_sample_window;
 
 	/*
 	 * Calculate statistics. Be careful - in case of massive ring buffer
 	 * computation on each execution may become costly.
 	 */
-	if (ring_buffer_size(entry) == MENTOR_TBL_ENTRY_STAT_SIZE)
+	if (ring_buffer_size(entry) == pgm_sample_window)
 	{
 		entry->avg_nblocks +=
-				(-entry->nblocks[entry->next_idx % MENTOR_TBL_ENTRY_STAT_SIZE] +
-										nblocks) / MENTOR_TBL_ENTRY_STAT_SIZE;
+				(-(int64) sample_decode(ring_nblocks[idx]) +
+				 (int64) sample_decode(nblocks_code)) / pgm_sample_window;
 		entry->avg_exec_time +=
-				(-entry->times[entry->next_idx % MENTOR_TBL_ENTRY_STAT_SIZE] +
-										exec_time) / MENTOR_TBL_ENTRY_STAT_SIZE;
+				(-sample_decode_time(ring_times[idx]) +
+				 sample_decode_time(time_code)) / pgm_sample_window;
 	}
 	else
 	{
-		entry->avg_nblocks = (entry->avg_nblocks * entry->next_idx + nblocks) /
+		entry->avg_nblocks = (entry->avg_nblocks * entry->next_idx +
+							  sample_decode(nblocks_code)) /
 														(entry->next_idx + 1);
-		entry->avg_exec_time = (entry->avg_exec_time * entry->next_idx + exec_time) /
+		entry->avg_exec_time = (entry->avg_exec_time * entry->next_idx +
+								sample_decode_time(time_code)) /
 														(entry->next_idx + 1);
 	}
 
-	entry->nblocks[entry->next_idx % MENTOR_TBL_ENTRY_STAT_SIZE] = nblocks;
-	entry->times[entry->next_idx % MENTOR_TBL_ENTRY_STAT_SIZE] = exec_time;
+	ring_nblocks[idx] = nblocks_code;
+	ring_times[idx] = time_code;
+	ring_rows[idx] = sample_encode(rows);
+	sample_set_kind(entry, idx, plan_kind);
 	entry->next_idx++;
 
-	dshash_release_lock(pgm_hash, entry);
+	/*
+	 * Compare with the threshold computed before this execution. Refresh it
+	 * once per window: sorting the ring on each execution would be costly.
+	 */
+	threshold = entry->outlier_threshold;
+	if (pgm_outlier_percentile > 0. &&
+		entry->next_idx % pgm_sample_window == 0)
+		entry->outlier_threshold = ring_time_percentile(entry,
+														pgm_outlier_percentile);
+	entry->calls++;
+	entry->total_time += exec_time;
+	entry_count_call(entry, GetCurrentStatementStartTimestamp());
+
+	if (pgm_history_buckets > 0)
+	{
+		int64				hour;
+		PGMHistoryBucket   *bucket;
+
+		/* Statement start time is cached, so don't ask the clock */
+		hour = GetCurrentStatementStartTimestamp() / USECS_PER_HOUR;
+		bucket = &ENTRY_HISTORY(entry)[hour % pgm_history_buckets];
+		if (bucket->hour != hour)
+		{
+			memset(bucket, 0, sizeof(PGMHistoryBucket));
+			bucket->hour = hour;
+		}
+		bucket->nexecs[plan_kind]++;
+		bucket->latency[plan_kind] += exec_time +
+			(plan_kind == PGM_PLAN_CUSTOM ? Max(entry->plan_time, 0.) : 0.);
+	}
+
+	if (entry->slo > 0.)
+	{
+		entry->slo_calls[1]++;
+		if (exec_time + (plan_kind == PGM_PLAN_CUSTOM ?
+						 Max(entry->plan_time, 0.) : 0.) > entry->slo)
+		{
+			entry->slo_violations[1]++;
+			regressed = true;
+		}
+	}
+
+	phases = &entry->phases[plan_kind];
+	phases->nexecs++;
+	phases->rows += rows;
+	phases->nblocks += nblocks;
+	for (idx = 0; idx < PGM_PHASES_NUM; idx++)
+		phases->time[idx] += phase_times[idx];
+
+	shape = entry->shape;
+	plan_time = (plan_kind == PGM_PLAN_CUSTOM) ? Max(entry->plan_time, 0.) : 0.;
+	need_sample = (DsaPointerIsValid(entry->shadow_source) &&
+				   entry->shadow_nparams > 0 &&
+				   !DsaPointerIsValid(entry->shadow_params));
+	LWLockRelease(&entry->lock);
+
+	if (need_sample && pgm_shadow_planning)
+		shadow_capture_params(queryId, params);
+
+	calibration_add(plan_kind, cost, exec_time);
+
+	if (pgm_outlier_percentile > 0. && threshold > 0. && exec_time > threshold)
+	{
+		outlier_capture(queryId, plan_kind, exec_time, threshold, nblocks,
+						params);
+		regressed = true;
+	}
+
+	sched_report(regressed);
+
+	if (shape != 0 && pgm_shape_pooling)
+	{
+		PGMShapeEntry  *sentry;
+		bool			found;
+
+		sentry = (PGMShapeEntry *) dshash_find_or_insert(pgm_shapes, &shape,
+														 &found);
+		if (!found)
+			shape_entry_init(sentry);
+		sentry->calls[plan_kind]++;
+		sentry->latency[plan_kind] += exec_time + plan_time;
+		sentry->exec_time += exec_time;
+		sentry->nblocks += nblocks;
+		dshash_release_lock(pgm_shapes, sentry);
+	}
 }
 
 static void
@@ -1032,11 +6471,13 @@ pgm_ProcessUtility_hook(PlannedStmt *pstmt, const char *queryString,
 						ParamListInfo params, QueryEnvironment *queryEnv,
 						DestReceiver *dest, QueryCompletion *qc)
 {
-	Node	   *parsetree = pstmt->utilityStmt;
-	uint64		queryId = UINT64CONST(0);
-	bool		deallocate_all = false;
+	Node			   *parsetree = pstmt->utilityStmt;
+	uint64				queryId = UINT64CONST(0);
+	CachedPlanSource   *plansource = NULL;
+	bool				deallocate_all = false;
+	uint64				start = 0;
 
-	if (!IsTransactionState() || !get_extension_oid(MODULENAME, true))
+	if (!OidIsValid(pgm_extension_oid()))
 	{
 		/*
 		 * Our extension doesn't exist in the database the backend is
@@ -1062,17 +6503,42 @@ pgm_ProcessUtility_hook(PlannedStmt *pstmt, const char *queryString,
 		{
 			PreparedStatement  *ps = FetchPreparedStatement(stmt->name, false);
 
-			queryId = (ps == NULL) ?	UINT64CONST(0) :
-										get_prepared_stmt_queryId(ps);
+			if (ps != NULL)
+			{
+				queryId = get_prepared_stmt_queryId(ps);
+				plansource = ps->plansource;
+			}
 		}
 		else
 			deallocate_all = true;
 	}
 
-	/* Let the core to execute command before the further operations */
-	call_process_utility_chain(pstmt, queryString, readOnlyTree,
-							   context, params, queryEnv,
-							   dest, qc);
+	/*
+	 * Parse analysis and rewriting of a prepared statement happen inside the
+	 * PREPARE command. Time it to see how much repeated preparations cost.
+	 */
+	if (IsA(parsetree, PrepareStmt))
+	{
+		start = pgm_time_now();
+
+		pgm_preparing = true;
+		PG_TRY();
+		{
+			call_process_utility_chain(pstmt, queryString, readOnlyTree,
+									   context, params, queryEnv,
+									   dest, qc);
+		}
+		PG_FINALLY();
+		{
+			pgm_preparing = false;
+		}
+		PG_END_TRY();
+	}
+	else
+		/* Let the core to execute command before the further operations */
+		call_process_utility_chain(pstmt, queryString, readOnlyTree,
+								   context, params, queryEnv,
+								   dest, qc);
 
 	/*
 	 * Now operation is finished successfully and we may do the job. Use
@@ -1086,13 +6552,20 @@ pgm_ProcessUtility_hook(PlannedStmt *pstmt, const char *queryString,
 			PrepareStmt		   *stmt = (PrepareStmt *) parsetree;
 			PreparedStatement  *ps = FetchPreparedStatement(stmt->name, true);
 
-			on_prepare(ps);
+			on_prepare(ps, pgm_time_diff_ms(start, pgm_time_now()));
 		}
 			break;
 		case T_DeallocateStmt:
 		{
 			if (queryId != UINT64CONST(0) || deallocate_all)
-				on_deallocate(queryId);
+				on_deallocate(queryId, plansource);
+		}
+			break;
+		case T_DiscardStmt:
+		{
+			/* DISCARD ALL drops all the prepared statements of the backend */
+			if (((DiscardStmt *) parsetree)->target == DISCARD_ALL)
+				on_deallocate(UINT64CONST(0), NULL);
 		}
 			break;
 		default:
@@ -1100,48 +6573,146 @@ pgm_ProcessUtility_hook(PlannedStmt *pstmt, const char *queryString,
 	}
 }
 
+/*
+ * Execution state of a tracked statement.
+ *
+ * We can't attach private data to the QueryDesc, so keep a short
+ * backend-local list of active executions. Each state lives in the query's
+ * es_query_cxt and is unlinked by the memory context callback, so an error
+ * in the middle of execution doesn't leave dangling entries.
+ */
+typedef struct PGMExecState
+{
+	QueryDesc			   *queryDesc;
+	MentorTblEntry		   *entry; /* the shared entry, if already known */
+	PGMPlanKind				plan_kind;
+	uint64					ticks[PGM_PHASES_NUM]; /* spent in each phase */
+	MemoryContextCallback	cb;
+	struct PGMExecState	   *next;
+} PGMExecState;
+
+static PGMExecState *pgm_exec_states = NULL;
+
+static void
+exec_state_release(void *arg)
+{
+	PGMExecState   *es = (PGMExecState *) arg;
+	PGMExecState  **prev = &pgm_exec_states;
+
+	while (*prev != NULL)
+	{
+		if (*prev == es)
+		{
+			*prev = es->next;
+			break;
+		}
+		prev = &(*prev)->next;
+	}
+}
+
+static PGMExecState *
+exec_state_create(QueryDesc *queryDesc)
+{
+	MemoryContext	cxt = queryDesc->estate->es_query_cxt;
+	PGMExecState   *es;
+
+	es = (PGMExecState *) MemoryContextAllocZero(cxt, sizeof(PGMExecState));
+	es->queryDesc = queryDesc;
+	es->cb.func = exec_state_release;
+	es->cb.arg = es;
+	MemoryContextRegisterResetCallback(cxt, &es->cb);
+
+	es->next = pgm_exec_states;
+	pgm_exec_states = es;
+	return es;
+}
+
+static inline PGMExecState *
+exec_state_lookup(QueryDesc *queryDesc)
+{
+	PGMExecState *es;
+
+	for (es = pgm_exec_states; es != NULL; es = es->next)
+	{
+		if (es->queryDesc == queryDesc)
+			return es;
+	}
+	return NULL;
+}
+
 static void
 pgm_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
-	uint64		queryId = queryDesc->plannedstmt->queryId;
+	uint64			queryId = queryDesc->plannedstmt->queryId;
+	bool			tracked = false;
+	PGMPlanKind		plan_kind = PGM_PLAN_CUSTOM;
+	MentorTblEntry *entry = NULL;
+	uint64			start = 0;
+
+	if (pgm_enabled(nesting_level) && queryId != UINT64CONST(0) &&
+		((eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0) && pgm_any_tracked())
+	{
+		LocaLPSEntry   *le;
+
+		/* Be gentle and track queries are known as prepared statements */
+		le = (LocaLPSEntry *) hash_search(pgm_local_hash, &queryId,
+										  HASH_FIND, NULL);
+		if (le != NULL)
+		{
+			tracked = true;
+			plan_kind = get_plan_kind(le, queryDesc->plannedstmt);
+			entry = local_entry_shared(le);
+			start = pgm_time_now();
+		}
+	}
 
 	if (prev_ExecutorStart)
 		prev_ExecutorStart(queryDesc, eflags);
 	else
 		standard_ExecutorStart(queryDesc, eflags);
 
-	if (pgm_enabled(nesting_level) && queryId != UINT64CONST(0) &&
-		((eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0))
+	if (tracked)
 	{
-		bool			found;
-
-		/* Be gentle and track queries are known as prepared statements */
-		(void) hash_search(pgm_local_hash, &queryId, HASH_FIND, &found);
-		if (!found)
-			return;
+		uint64			duration = pgm_time_now() - start;
+		PGMExecState   *es;
 
+		/*
+		 * Only buffer usage is needed from the instrumentation: execution time
+		 * is measured by ourselves using the chosen timing source.
+		 */
 		if (queryDesc->totaltime == NULL)
 		{
 			MemoryContext oldcxt;
 
 			oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
-			queryDesc->totaltime =
-					InstrAlloc(1, INSTRUMENT_BUFFERS | INSTRUMENT_TIMER, false);
+			queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_BUFFERS, false);
 			MemoryContextSwitchTo(oldcxt);
 		}
+
+		es = exec_state_create(queryDesc);
+		es->entry = entry;
+		es->plan_kind = plan_kind;
+		es->ticks[PGM_PHASE_START] = duration;
 	}
 }
 
 static void
 pgm_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count)
 {
+	PGMExecState *es = exec_state_lookup(queryDesc);
+
 	nesting_level++;
 	PG_TRY();
 	{
+		uint64	start = (es != NULL) ? pgm_time_now() : 0;
+
 		if (prev_ExecutorRun)
 			prev_ExecutorRun(queryDesc, direction, count);
 		else
 			standard_ExecutorRun(queryDesc, direction, count);
+
+		if (es != NULL)
+			es->ticks[PGM_PHASE_RUN] += pgm_time_now() - start;
 	}
 	PG_FINALLY();
 	{
@@ -1153,13 +6724,20 @@ pgm_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count)
 static void
 pgm_ExecutorFinish(QueryDesc *queryDesc)
 {
+	PGMExecState *es = exec_state_lookup(queryDesc);
+
 	nesting_level++;
 	PG_TRY();
 	{
+		uint64	start = (es != NULL) ? pgm_time_now() : 0;
+
 		if (prev_ExecutorFinish)
 			prev_ExecutorFinish(queryDesc);
 		else
 			standard_ExecutorFinish(queryDesc);
+
+		if (es != NULL)
+			es->ticks[PGM_PHASE_FINISH] += pgm_time_now() - start;
 	}
 	PG_FINALLY();
 	{
@@ -1171,28 +6749,83 @@ pgm_ExecutorFinish(QueryDesc *queryDesc)
 static void
 pgm_ExecutorEnd(QueryDesc *queryDesc)
 {
-	uint64		queryId = queryDesc->plannedstmt->queryId;
+	uint64			queryId = queryDesc->plannedstmt->queryId;
+	PGMExecState   *es = NULL;
+	BufferUsage		bufusage = {0};
+	PGMPlanKind		plan_kind = PGM_PLAN_CUSTOM;
+	MentorTblEntry *entry = NULL;
+	double			phase_times[PGM_PHASES_NUM] = {0};
+	uint64			rows = 0;
+	uint64			start = 0;
+	double			cost = 0.;
 
 	if (queryId != UINT64CONST(0) && queryDesc->totaltime &&
 		pgm_enabled(nesting_level) &&
 		((queryDesc->estate->es_top_eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0))
-	{
-		bool	found;
+		/* The state exists only for statements, tracked in ExecutorStart */
+		es = exec_state_lookup(queryDesc);
 
-		(void) hash_search(pgm_local_hash, &queryId, HASH_FIND, &found);
-		if (found)
-		{
-			InstrEndLoop(queryDesc->totaltime);
+	if (es != NULL)
+	{
+		int i;
 
-			on_execute(queryId, &queryDesc->totaltime->bufusage,
-					   queryDesc->totaltime->total * 1000.0);
-		}
+		/*
+		 * Both the state and the instrumentation are freed by ExecutorEnd.
+		 * Copy everything we need in advance.
+		 */
+		bufusage = queryDesc->totaltime->bufusage;
+		rows = queryDesc->estate->es_processed;
+		cost = queryDesc->plannedstmt->planTree->total_cost;
+		plan_kind = es->plan_kind;
+		entry = es->entry;
+		for (i = 0; i < PGM_PHASES_NUM; i++)
+			phase_times[i] = pgm_ticks_to_ms(es->ticks[i]);
+		start = pgm_time_now();
 	}
 
 	if (prev_ExecutorEnd)
 		prev_ExecutorEnd(queryDesc);
 	else
 		standard_ExecutorEnd(queryDesc);
+
+	if (es != NULL)
+	{
+		phase_times[PGM_PHASE_END] = pgm_time_diff_ms(start, pgm_time_now());
+		on_execute(queryId, entry, &bufusage, rows, plan_kind, phase_times,
+				   queryDesc->params, cost);
+	}
+}
+
+/*
+ * Report registrations made in the transaction before its commit and apply
+ * pin requests after it.
+ *
+ * Prepared statements survive an abort, so pending registrations are kept
+ * till the next flush in that case. Pin requests of a prepared transaction
+ * are dropped: the table is re-applied after its invalidation comes.
+ */
+static void
+pgm_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			if (pgm_npending > 0 && state != NULL)
+				flush_registrations();
+			break;
+		case XACT_EVENT_COMMIT:
+			if (pins_requests != NIL)
+				pins_apply_requests();
+			/* FALLTHROUGH */
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			/* The memory is released with the transaction */
+			pins_requests = NIL;
+			pins_written = false;
+			break;
+		default:
+			break;
+	}
 }
 
 void
@@ -1200,6 +6833,201 @@ _PG_init(void)
 {
 	EnableQueryId();
 
+	DefineCustomEnumVariable(MODULENAME".timing_source",
+							 "Selects the clock used to time planning and execution of tracked statements.",
+							 "The 'tsc' source reads the CPU time-stamp counter directly. It is calibrated once per server and falls back to the system clock if the CPU doesn't provide an invariant TSC.",
+							 &pgm_timing_source,
+							 PGM_TIMING_CLOCK,
+							 timing_source_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	pgm_timing_init();
+
+	DefineCustomIntVariable(MODULENAME".sample_window",
+							"Number of the last executions to keep statistics on.",
+							"Defines size of the ring buffer in each entry of the shared table.",
+							&pgm_sample_window,
+							10,
+							2,
+							1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable(MODULENAME".normalize_by_rows",
+							 "Measures variance of a statement cost per processed row.",
+							 "Prevents switching to custom plans statements whose cost varies only because parameters select different numbers of rows.",
+							 &pgm_normalize_by_rows,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable(MODULENAME".confidence_level",
+							 "Confidence level required to switch plan cache mode.",
+							 "Switching rules are applied only if the difference they are based on is statistically significant at this level. Zero disables the check.",
+							 &pgm_confidence_level,
+							 0.,
+							 0.,
+							 0.999,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable(MODULENAME".min_samples",
+							"Minimal number of samples to make a decision on a statement.",
+							NULL,
+							&pgm_min_samples,
+							2,
+							2,
+							1024,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable(MODULENAME".slo_margin",
+							 "Relative distance to the latency target within which plan mode isn't switched.",
+							 "Also the minimal relative improvement of the p99 latency estimate to switch a statement with a latency target.",
+							 &pgm_slo_margin,
+							 0.1,
+							 0.,
+							 1.,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable(MODULENAME".outlier_percentile",
+							 "Captures executions slower than this percentile of the recent ones, with their parameters.",
+							 "The percentile is computed over the ring buffer of the statement. Zero disables the capture.",
+							 &pgm_outlier_percentile,
+							 0.,
+							 0.,
+							 100.,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable(MODULENAME".shadow_planning",
+							 "Keeps source text and sample parameter values of statements for the shadow planner.",
+							 "See pg_mentor_shadow_plan().",
+							 &pgm_shadow_planning,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable(MODULENAME".shape_pooling",
+							 "Pools statistics of statements with the same structure over different relations.",
+							 "Statements without enough samples of their own inherit the plan cache mode learned on their shape.",
+							 &pgm_shape_pooling,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable(MODULENAME".history_buckets",
+							"Number of hourly buckets of statistics history kept for each statement.",
+							"The history is used to learn plan cache mode schedule by hour of the day. Zero disables it.",
+							&pgm_history_buckets,
+							0,
+							0,
+							48,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable(MODULENAME".scheduler",
+							 "Starts the launcher running the decision strategy in all databases.",
+							 "Requires loading the module with shared_preload_libraries.",
+							 &pgm_scheduler,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable(MODULENAME".scheduler_naptime",
+							"Time between cycles of the scheduler.",
+							NULL,
+							&pgm_scheduler_naptime,
+							60,
+							1,
+							86400,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable(MODULENAME".scheduler_max_workers",
+							"Maximum number of workers the scheduler runs at once.",
+							NULL,
+							&pgm_scheduler_max_workers,
+							2,
+							1,
+							64,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable(MODULENAME".scheduler_cycle_budget",
+							"Total run time of the scheduler workers in one cycle.",
+							"Databases not served within the budget wait for the next cycle. Zero means no limit.",
+							&pgm_scheduler_cycle_budget,
+							10000,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	if (pgm_scheduler && process_shared_preload_libraries_in_progress)
+	{
+		BackgroundWorker	worker = {0};
+
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 10;
+		snprintf(worker.bgw_library_name, MAXPGPATH, MODULENAME);
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgm_scheduler_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_mentor scheduler");
+		snprintf(worker.bgw_type, BGW_MAXLEN, "pg_mentor scheduler");
+		RegisterBackgroundWorker(&worker);
+	}
+
+	pgm_history_offset = MAXALIGN(MENTOR_TBL_ENTRY_SIZE(pgm_sample_window));
+	pgm_entry_size = pgm_history_offset +
+		sizeof(PGMHistoryBucket) * pgm_history_buckets;
+	dsh_params.entry_size = pgm_entry_size;
+
 	/* Cache oid for further direct calls */
 	psfuncoid = fmgr_internal_function(psfuncname);
 	Assert(psfuncoid != InvalidOid);
@@ -1220,6 +7048,9 @@ _PG_init(void)
 	ExecutorEnd_hook = pgm_ExecutorEnd;
 
 	recreate_local_htab();
+	RegisterXactCallback(pgm_xact_callback, NULL);
+	RegisterSubXactCallback(pgm_subxact_callback, NULL);
+	CacheRegisterRelcacheCallback(pgm_relcache_callback, (Datum) 0);
 
 	MarkGUCPrefixReserved(MODULENAME);
 }
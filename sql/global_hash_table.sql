@@ -77,6 +77,23 @@ SELECT p.refcounter,p.plan_cache_mode,p.statnum,p.nblocks,s.query
 FROM pg_mentor_show_prepared_statements(-1) p
 JOIN pg_stat_statements s USING (queryid) WHERE s.query LIKE '%\+random()%';
 
+-- Server-side filtering: statements having enough samples, without arrays
+SELECT p.statnum, p.nblocks, p.calls, s.query
+FROM pg_mentor_show_prepared_statements(-1, min_samples => 6,
+                                        with_samples => false) p
+JOIN pg_stat_statements s USING (queryid);
+
+-- Executor phases are timed separately for custom and generic plans. After
+-- five custom plans the core switches the statement to the generic one.
+SELECT e.plan_kind, e.calls, e.rows
+FROM pg_mentor_show_exec_phases() e JOIN pg_stat_statements s USING (queryid)
+WHERE s.query LIKE '%\+random()%' ORDER BY e.plan_kind;
+
+-- Prepare churn: stmt0 has been prepared twice and deallocated once
+SELECT c.prepares, c.deallocates, s.query
+FROM pg_mentor_prepare_churn() c JOIN pg_stat_statements s USING (queryid)
+WHERE s.query LIKE '%\+random()%';
+
 -- Warm-up planner caches
 SELECT oid FROM pg_class WHERE oid = 2966;
 -- Not sure how stable it is, but seems pretty good if nothing in index scan
@@ -90,6 +107,10 @@ FROM pg_mentor_show_prepared_statements(-1) p
 JOIN pg_stat_statements s USING (queryid) WHERE s.query LIKE '%pg_class%';
 
 
+-- Timing source micro-benchmark: the system clock is always available
+SELECT source, active, calls FROM pg_mentor_timing_overhead(1000)
+WHERE source = 'clock';
+
 DEALLOCATE ALL;
 DROP FUNCTION show_entries();
 DROP EXTENSION pg_mentor;
@@ -199,7 +199,136 @@ EXECUTE qry2(1); -- must be generic
 EXPLAIN (ANALYZE, COSTS OFF, BUFFERS OFF, TIMING OFF, SUMMARY OFF)
 EXECUTE qry1(ARRAY[1,3]); -- must be custom
 
+-- Decision counters are exported in the OpenMetrics format
+SELECT line FROM regexp_split_to_table(pg_mentor_metrics(0), E'\n') AS line
+WHERE line LIKE 'pg_mentor_decisions_total%';
+
+-- Targeted resets: statistics of statements over the partitioned table (found
+-- by its partition) and decisions for statements over the "test" table.
+SELECT pg_mentor_reset(relid => 'part1', decisions => false);
+SELECT pg_mentor_reset(relid => 'test', stats => false);
+
+-- Per-statement planner settings are applied on planning of this queryId only
+SELECT get_queryId('SELECT * FROM part1 WHERE id < 5') AS ps_query_id \gset
+SELECT pg_mentor_set_planner_setting(:ps_query_id, 'enable_indexscan', 'off');
+SELECT pg_mentor_set_planner_setting(:ps_query_id, 'enable_bitmapscan', 'off');
+SELECT pg_mentor_set_planner_setting(:ps_query_id, 'work_mem', '1MB'); -- ERROR
+EXPLAIN (COSTS OFF) SELECT * FROM part1 WHERE id < 5;
+SHOW enable_indexscan;
+SELECT pg_mentor_set_planner_setting(:ps_query_id, 'enable_indexscan', NULL);
+SELECT name, value FROM pg_mentor_show_planner_settings()
+WHERE queryid = :ps_query_id;
+SELECT pg_mentor_set_planner_setting(:ps_query_id, 'enable_bitmapscan', NULL);
+
+-- Pinned decisions are kept in the pinned_modes table and survive resets
+SELECT pg_mentor_set_plan_mode(:query_id, 1, fixed => true);
+SELECT queryid = :query_id AS pinned, plan_cache_mode FROM pinned_modes;
+SELECT pg_mentor_reset(ARRAY[:query_id]::bigint[], stats => false);
+SELECT plan_cache_mode, fixed
+FROM pg_mentor_show_prepared_statements(-1, ARRAY[:query_id]::bigint[]);
+SELECT pg_mentor_set_plan_mode(:query_id, 0); -- unpin
+SELECT count(*) FROM pinned_modes;
+-- A pin made in a rolled back transaction is never applied
+BEGIN;
+SELECT pg_mentor_set_plan_mode(:query_id, 1, fixed => true);
+ROLLBACK;
+SELECT plan_cache_mode, fixed
+FROM pg_mentor_show_prepared_statements(-1, ARRAY[:query_id]::bigint[]);
+
+-- The same statement over tables of different schemas shares the shape
+SET pg_mentor.shape_pooling = on;
+CREATE SCHEMA tenant1;
+CREATE TABLE tenant1.t (x integer);
+CREATE SCHEMA tenant2;
+CREATE TABLE tenant2.t (x integer);
+SET search_path = tenant1, public;
+PREPARE tenant_stmt (integer) AS SELECT * FROM t WHERE x = $1;
+SET search_path = tenant2, public;
+PREPARE tenant_stmt2 (integer) AS SELECT * FROM t WHERE x = $1;
+RESET search_path;
+SELECT cardinality(members), plan_cache_mode FROM pg_mentor_show_shapes();
+RESET pg_mentor.shape_pooling;
+
+-- Executions slower than the percentile of recent ones are captured with
+-- their parameters
+SET pg_mentor.outlier_percentile = 50;
+PREPARE sleepy (float8) AS SELECT count(*) FROM pg_sleep($1);
+SELECT 'EXECUTE sleepy(0)' FROM generate_series(1, 10) \gexec
+EXECUTE sleepy(0.1);
+SELECT exec_time > threshold AS slow, params FROM pg_mentor_show_outliers();
+RESET pg_mentor.outlier_percentile;
+
+-- Shadow planning of a statement with its sampled parameter values
+SET pg_mentor.shadow_planning = on;
+PREPARE shadow_stmt (integer) AS SELECT * FROM test WHERE x < $1;
+EXECUTE shadow_stmt(1);
+-- Only the text of the PREPARE itself is kept from a multi-statement string
+SELECT 1 AS one \; PREPARE shadow_multi (integer) AS SELECT * FROM test WHERE x > $1;
+EXECUTE shadow_multi(1);
+SELECT pg_mentor_shadow_plan();
+SELECT generic_cost IS NOT NULL AS generic, custom_cost IS NOT NULL AS custom
+FROM pg_mentor_show_shadow_plans();
+RESET pg_mentor.shadow_planning;
+
+-- Cost-to-time models are fitted from all the executions
+SELECT plan_kind, samples > 0 AS calibrated FROM pg_mentor_calibration();
+
+-- The scheduler is off: no databases are registered
+SELECT count(*) FROM pg_mentor_show_scheduler();
+
+-- Recency of a statement: the last execution and planning and the call rate
+PREPARE recent (integer) AS SELECT count(*) FROM test WHERE x > $1;
+EXECUTE recent(1) \gset
+SELECT last_executed IS NOT NULL AS executed,
+       last_planned IS NOT NULL AS planned, call_rate > 0 AS active
+FROM pg_mentor_show_prepared_statements(-1,
+  ARRAY[get_queryId('EXECUTE recent(1)')]);
+
+-- Repeated queryIds are shown once; top_n limits the output
+SELECT count(*) FROM pg_mentor_show_prepared_statements(-1,
+  ARRAY[:query_id, NULL, :query_id]::bigint[]);
+SELECT count(*) FROM pg_mentor_show_prepared_statements(-1, top_n => 2);
+
+-- The sample window is fixed at server start. The ring buffer keeps only the
+-- last pg_mentor.sample_window executions
+SHOW pg_mentor.sample_window;
+SET pg_mentor.sample_window = 20; -- ERROR
+PREPARE windowed (integer) AS SELECT * FROM test WHERE x = $1;
+\o /dev/null
+EXECUTE windowed(1) \watch i=0 c=15
+\o
+SELECT statnum, cardinality(exec_times) AS samples
+FROM pg_mentor_show_prepared_statements(-1,
+  ARRAY[get_queryId('EXECUTE windowed(1)')]);
+
+-- DISCARD ALL drops prepared statements as DEALLOCATE ALL does
+PREPARE discarded (integer) AS SELECT count(*) FROM test WHERE x = $1;
+EXECUTE discarded(1);
+DISCARD ALL;
+PREPARE discarded (integer) AS SELECT count(*) FROM test WHERE x = $1;
+EXECUTE discarded(1);
+SELECT refcounter FROM pg_mentor_show_prepared_statements(-1,
+  ARRAY[get_queryId('EXECUTE discarded(1)')]);
+
+-- DEALLOCATE ALL counts as a deallocation of each statement it drops
+PREPARE churned (integer) AS SELECT count(*) FROM test WHERE x < $1;
+DEALLOCATE ALL;
+PREPARE churned (integer) AS SELECT count(*) FROM test WHERE x < $1;
+DEALLOCATE ALL;
+PREPARE churned (integer) AS SELECT count(*) FROM test WHERE x < $1;
+SELECT prepares, deallocates FROM pg_mentor_prepare_churn()
+WHERE queryid = get_queryId('EXECUTE churned(1)');
+
+-- Call rates of the top statements are exported from consistent copies
+SELECT count(*) FROM regexp_split_to_table(pg_mentor_metrics(2), E'\n') AS line
+WHERE line LIKE 'pg_mentor_statement_call_rate{%';
+
+-- A statement listed twice is reset once
+SELECT pg_mentor_reset(ARRAY[:query_id, :query_id]::bigint[], stats => false);
+
 DEALLOCATE ALL;
 DROP TABLE test CASCADE;
+DROP TABLE tenant1.t, tenant2.t;
+DROP SCHEMA tenant1, tenant2;
 DROP EXTENSION pg_stat_statements;
 DROP EXTENSION pg_mentor;